@@ -0,0 +1,167 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "capture.h"
+#include "frame.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+void capture_encode_header(uint8_t *header, uint8_t device, capture_type_t type, uint64_t timestamp,
+  uint16_t length);
+
+int capture_open(capture_t *capture, const char *path)
+{
+  capture->records = 0;
+  capture->bytes = 0;
+  capture->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (capture->fd < 0) {
+    return -1;
+  }
+
+  // New files start with the magic value.
+  struct stat st;
+  if (fstat(capture->fd, &st) != 0) {
+    capture_close(capture);
+    return -1;
+  }
+
+  if (st.st_size == 0 && write(capture->fd, CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH) != CAPTURE_MAGIC_LENGTH) {
+    capture_close(capture);
+    return -1;
+  }
+
+  // Records appended after a restart use a new time base.
+  if (capture_write(capture, 0, CAPTURE_SESSION, frame_timestamp_now(), NULL, 0) != 0) {
+    capture_close(capture);
+    return -1;
+  }
+
+  return 0;
+}
+
+void capture_close(capture_t *capture)
+{
+  if (capture->fd >= 0) {
+    close(capture->fd);
+  }
+  capture->fd = -1;
+}
+
+void capture_encode_header(uint8_t *header, uint8_t device, capture_type_t type, uint64_t timestamp,
+  uint16_t length)
+{
+  for (int i = 0; i < 8; i++) {
+    header[i] = (uint8_t) (timestamp >> (8 * i));
+  }
+  header[8] = (uint8_t) length;
+  header[9] = (uint8_t) (length >> 8);
+  header[10] = device;
+  header[11] = (uint8_t) type;
+}
+
+int capture_write(capture_t *capture, uint8_t device, capture_type_t type, uint64_t timestamp,
+  const uint8_t *data, size_t length)
+{
+  if (capture->fd < 0) {
+    return -1;
+  }
+
+  do {
+    size_t chunk = length > CAPTURE_MAX_RECORD_LENGTH ? CAPTURE_MAX_RECORD_LENGTH : length;
+    uint8_t header[CAPTURE_RECORD_HEADER_SIZE];
+    capture_encode_header(header, device, type, timestamp, chunk);
+
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void*) data;
+    iov[1].iov_len = chunk;
+
+    ssize_t written;
+    do {
+      written = writev(capture->fd, iov, 2);
+    } while (written < 0 && errno == EINTR);
+
+    if (written != (ssize_t) (sizeof(header) + chunk)) {
+      return -1;
+    }
+
+    capture->records++;
+    capture->bytes += chunk;
+    data += chunk;
+    length -= chunk;
+  } while (length > 0);
+
+  return 0;
+}
+
+int capture_reader_open(capture_reader_t *reader, const char *path)
+{
+  reader->file = fopen(path, "rb");
+  if (!reader->file) {
+    return -1;
+  }
+
+  char magic[CAPTURE_MAGIC_LENGTH];
+  if (fread(magic, 1, sizeof(magic), reader->file) != sizeof(magic) ||
+      memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH) != 0) {
+    capture_reader_close(reader);
+    return -1;
+  }
+
+  return 0;
+}
+
+void capture_reader_close(capture_reader_t *reader)
+{
+  if (reader->file) {
+    fclose(reader->file);
+  }
+  reader->file = NULL;
+}
+
+int capture_read(capture_reader_t *reader, capture_record_t *record)
+{
+  uint8_t header[CAPTURE_RECORD_HEADER_SIZE];
+  size_t size = fread(header, 1, sizeof(header), reader->file);
+  if (size == 0 && feof(reader->file)) {
+    return 0;
+  } else if (size != sizeof(header)) {
+    return -1;
+  }
+
+  record->timestamp = 0;
+  for (int i = 0; i < 8; i++) {
+    record->timestamp |= (uint64_t) header[i] << (8 * i);
+  }
+  record->length = header[8] | (header[9] << 8);
+  record->device = header[10];
+  record->type = (capture_type_t) header[11];
+  record->data = reader->buffer;
+
+  if (fread(reader->buffer, 1, record->length, reader->file) != record->length) {
+    return -1;
+  }
+
+  return 1;
+}
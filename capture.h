@@ -0,0 +1,142 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_DRIVER_CAPTURE_H
+#define KORUZA_DRIVER_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/**
+ * Capture files start with a magic value followed by records. Each record has
+ * a 12-byte little-endian header (timestamp, length, device and type) which is
+ * followed by the record data.
+ */
+#define CAPTURE_MAGIC "KRZCAP01"
+#define CAPTURE_MAGIC_LENGTH 8
+#define CAPTURE_RECORD_HEADER_SIZE 12
+#define CAPTURE_MAX_RECORD_LENGTH 65535
+
+/**
+ * Capture record types.
+ */
+typedef enum {
+  // Bytes read from a device.
+  CAPTURE_RX = 0,
+  // Bytes written to a device.
+  CAPTURE_TX = 1,
+  // Name of a device.
+  CAPTURE_DEVICE_NAME = 2,
+  // Start of a capture session. Monotonic timestamps are only comparable
+  // within a session, as the clock restarts when the system reboots.
+  CAPTURE_SESSION = 3,
+} capture_type_t;
+
+/**
+ * Capture writer.
+ */
+typedef struct {
+  int fd;
+  // Number of records and data bytes written.
+  uint64_t records;
+  uint64_t bytes;
+} capture_t;
+
+/**
+ * Capture record.
+ */
+typedef struct {
+  // Monotonic time of the record (in nanoseconds).
+  uint64_t timestamp;
+  uint8_t device;
+  capture_type_t type;
+  uint16_t length;
+  // Record data, valid until the next record is read.
+  const uint8_t *data;
+} capture_record_t;
+
+/**
+ * Capture reader. As it holds a buffer for the largest record, instances
+ * should not be placed on the stack.
+ */
+typedef struct {
+  FILE *file;
+  uint8_t buffer[CAPTURE_MAX_RECORD_LENGTH];
+} capture_reader_t;
+
+/**
+ * Opens a capture file for appending and starts a new session. The file is
+ * created when it does not exist yet.
+ *
+ * @param capture Capture writer instance
+ * @param path Path to the capture file
+ * @return Zero on success, -1 on failure
+ */
+int capture_open(capture_t *capture, const char *path);
+
+/**
+ * Closes a capture file.
+ *
+ * @param capture Capture writer instance
+ */
+void capture_close(capture_t *capture);
+
+/**
+ * Appends a record to a capture file. Each record is written with a single
+ * system call, so records are never interleaved. Data longer than the
+ * maximum record length is split into multiple records.
+ *
+ * @param capture Capture writer instance
+ * @param device Device identifier
+ * @param type Record type
+ * @param timestamp Monotonic time (in nanoseconds)
+ * @param data Record data
+ * @param length Length of record data
+ * @return Zero on success, -1 on failure
+ */
+int capture_write(capture_t *capture, uint8_t device, capture_type_t type, uint64_t timestamp,
+  const uint8_t *data, size_t length);
+
+/**
+ * Opens a capture file for reading.
+ *
+ * @param reader Capture reader instance
+ * @param path Path to the capture file
+ * @return Zero on success, -1 on failure or if the file is not a capture
+ */
+int capture_reader_open(capture_reader_t *reader, const char *path);
+
+/**
+ * Closes a capture file opened for reading.
+ *
+ * @param reader Capture reader instance
+ */
+void capture_reader_close(capture_reader_t *reader);
+
+/**
+ * Reads the next record from a capture file.
+ *
+ * @param reader Capture reader instance
+ * @param record Destination record
+ * @return One when a record was read, zero at the end of the file and -1 on
+ *   a truncated or invalid record
+ */
+int capture_read(capture_reader_t *reader, capture_record_t *record);
+
+#endif
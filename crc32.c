@@ -41,7 +41,22 @@
  */
 #include "crc32.h"
 
-static uint32_t crc32_tab[] = {
+#include <string.h>
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CRC32_HAVE_PCLMUL
+#include <immintrin.h>
+#endif
+
+static const uint32_t crc32_tab[256] = {
 	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
 	0xe963a535, 0x9e6495a3,	0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
 	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
@@ -87,15 +102,424 @@ static uint32_t crc32_tab[] = {
 	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
 };
 
-uint32_t crc32(uint32_t crc, const void *buf, size_t size)
-{
-	const uint8_t *p;
+/*
+ * Reflected CRC32 polynomial, used by the table-free implementation.
+ */
+#define CRC32_POLYNOMIAL 0xedb88320
+
+/*
+ * Slicing-by-N tables, generated from crc32_tab on initialization. Table k
+ * holds the CRC of a byte followed by k zero bytes.
+ */
+static uint32_t crc32_slice_tab[16][256];
+static int crc32_slice_tab_ready;
+
+typedef uint32_t (*crc32_fn)(uint32_t crc, const uint8_t *p, size_t size);
 
-	p = buf;
-	crc = crc ^ ~0U;
+static uint32_t crc32_dispatch(uint32_t crc, const uint8_t *p, size_t size);
 
+static crc32_fn crc32_impl = crc32_dispatch;
+static crc32_backend_t crc32_backend = CRC32_BACKEND_AUTO;
+
+static const char *crc32_backend_names[__CRC32_BACKEND_MAX] = {
+	[CRC32_BACKEND_AUTO] = "auto",
+	[CRC32_BACKEND_BYTEWISE] = "bytewise",
+	[CRC32_BACKEND_BITWISE] = "bitwise",
+	[CRC32_BACKEND_SLICING_8] = "slicing-by-8",
+	[CRC32_BACKEND_SLICING_16] = "slicing-by-16",
+	[CRC32_BACKEND_ARMV8] = "armv8",
+	[CRC32_BACKEND_PCLMUL] = "pclmul",
+};
+
+/*
+ * The backends below operate on the inverted CRC register value.
+ */
+static inline uint32_t
+crc32_bytes(uint32_t crc, const uint8_t *p, size_t size)
+{
 	while (size--)
 		crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
 
-	return crc ^ ~0U;
+	return crc;
+}
+
+static inline uint32_t
+crc32_load_le(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	    ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t
+crc32_bytewise(uint32_t crc, const uint8_t *p, size_t size)
+{
+	return crc32_bytes(crc, p, size);
+}
+
+static uint32_t
+crc32_bitwise(uint32_t crc, const uint8_t *p, size_t size)
+{
+	while (size--) {
+		crc ^= *p++;
+		for (int k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (CRC32_POLYNOMIAL & -(crc & 1));
+	}
+
+	return crc;
+}
+
+static uint32_t
+crc32_slicing_8(uint32_t crc, const uint8_t *p, size_t size)
+{
+	const uint32_t (*t)[256] = crc32_slice_tab;
+
+	while (size >= 8) {
+		uint32_t one = crc32_load_le(p) ^ crc;
+		uint32_t two = crc32_load_le(p + 4);
+
+		crc = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^
+		    t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24] ^
+		    t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^
+		    t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+
+		p += 8;
+		size -= 8;
+	}
+
+	return crc32_bytes(crc, p, size);
+}
+
+static uint32_t
+crc32_slicing_16(uint32_t crc, const uint8_t *p, size_t size)
+{
+	const uint32_t (*t)[256] = crc32_slice_tab;
+
+	while (size >= 16) {
+		uint32_t one = crc32_load_le(p) ^ crc;
+		uint32_t two = crc32_load_le(p + 4);
+		uint32_t three = crc32_load_le(p + 8);
+		uint32_t four = crc32_load_le(p + 12);
+
+		crc = t[15][one & 0xFF] ^ t[14][(one >> 8) & 0xFF] ^
+		    t[13][(one >> 16) & 0xFF] ^ t[12][one >> 24] ^
+		    t[11][two & 0xFF] ^ t[10][(two >> 8) & 0xFF] ^
+		    t[9][(two >> 16) & 0xFF] ^ t[8][two >> 24] ^
+		    t[7][three & 0xFF] ^ t[6][(three >> 8) & 0xFF] ^
+		    t[5][(three >> 16) & 0xFF] ^ t[4][three >> 24] ^
+		    t[3][four & 0xFF] ^ t[2][(four >> 8) & 0xFF] ^
+		    t[1][(four >> 16) & 0xFF] ^ t[0][four >> 24];
+
+		p += 16;
+		size -= 16;
+	}
+
+	return crc32_bytes(crc, p, size);
+}
+
+#if defined(__ARM_FEATURE_CRC32)
+/*
+ * ARMv8 CRC32 instructions implement the same (reflected) polynomial.
+ */
+static uint32_t
+crc32_armv8(uint32_t crc, const uint8_t *p, size_t size)
+{
+	while (size && ((uintptr_t)p & 7)) {
+		crc = __crc32b(crc, *p++);
+		size--;
+	}
+
+#if defined(__aarch64__)
+	while (size >= 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32d(crc, v);
+		p += 8;
+		size -= 8;
+	}
+#endif
+
+	while (size >= 4) {
+		uint32_t v;
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32w(crc, v);
+		p += 4;
+		size -= 4;
+	}
+
+	while (size--)
+		crc = __crc32b(crc, *p++);
+
+	return crc;
+}
+
+static int
+crc32_armv8_supported(void)
+{
+#if defined(__linux__) && defined(__aarch64__) && defined(HWCAP_CRC32)
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#elif defined(__linux__) && defined(HWCAP2_CRC32)
+	return (getauxval(AT_HWCAP2) & HWCAP2_CRC32) != 0;
+#else
+	return 1;
+#endif
+}
+#endif
+
+#if defined(CRC32_HAVE_PCLMUL)
+/*
+ * Carry-less multiplication folding, as described in "Fast CRC Computation
+ * for Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009). The
+ * constants are the bit-reflected fold and Barrett reduction constants for
+ * the CRC32 polynomial. Requires at least 64 bytes, in multiples of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t
+crc32_pclmul_fold(uint32_t crc, const uint8_t *p, size_t size)
+{
+	static const uint64_t k1k2[2] __attribute__((aligned(16))) =
+	    { 0x0154442bd4, 0x01c6e41596 };
+	static const uint64_t k3k4[2] __attribute__((aligned(16))) =
+	    { 0x01751997d0, 0x00ccaa009e };
+	static const uint64_t k5k0[2] __attribute__((aligned(16))) =
+	    { 0x0163cd6124, 0x0000000000 };
+	static const uint64_t poly[2] __attribute__((aligned(16))) =
+	    { 0x01db710641, 0x01f7011641 };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+	p += 64;
+	size -= 64;
+
+	/* Fold four blocks in parallel. */
+	while (size >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		y5 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+		p += 64;
+		size -= 64;
+	}
+
+	/* Fold into 128 bits. */
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* Fold remaining 16 byte blocks. */
+	while (size >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *)p);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		p += 16;
+		size -= 16;
+	}
+
+	/* Fold 128 bits to 64 bits. */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits. */
+	x0 = _mm_load_si128((const __m128i *)poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t
+crc32_pclmul(uint32_t crc, const uint8_t *p, size_t size)
+{
+	if (size >= 64) {
+		size_t chunk = size & ~(size_t)15;
+
+		crc = crc32_pclmul_fold(crc, p, chunk);
+		p += chunk;
+		size -= chunk;
+	}
+
+	return crc32_slicing_8(crc, p, size);
+}
+
+static int
+crc32_pclmul_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+static void
+crc32_slice_tab_init(void)
+{
+	if (crc32_slice_tab_ready)
+		return;
+
+	for (int n = 0; n < 256; n++)
+		crc32_slice_tab[0][n] = crc32_tab[n];
+
+	for (int k = 1; k < 16; k++) {
+		for (int n = 0; n < 256; n++) {
+			uint32_t c = crc32_slice_tab[k - 1][n];
+			crc32_slice_tab[k][n] = (c >> 8) ^ crc32_tab[c & 0xFF];
+		}
+	}
+
+	crc32_slice_tab_ready = 1;
+}
+
+static crc32_fn
+crc32_backend_fn(crc32_backend_t backend)
+{
+	switch (backend) {
+	case CRC32_BACKEND_BYTEWISE:
+		return crc32_bytewise;
+	case CRC32_BACKEND_BITWISE:
+		return crc32_bitwise;
+	case CRC32_BACKEND_SLICING_8:
+		crc32_slice_tab_init();
+		return crc32_slicing_8;
+	case CRC32_BACKEND_SLICING_16:
+		crc32_slice_tab_init();
+		return crc32_slicing_16;
+#if defined(__ARM_FEATURE_CRC32)
+	case CRC32_BACKEND_ARMV8:
+		return crc32_armv8_supported() ? crc32_armv8 : NULL;
+#endif
+#if defined(CRC32_HAVE_PCLMUL)
+	case CRC32_BACKEND_PCLMUL:
+		if (!crc32_pclmul_supported())
+			return NULL;
+		crc32_slice_tab_init();
+		return crc32_pclmul;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * Compares a backend against the reference table implementation over all
+ * lengths and alignments of a pseudo-random buffer.
+ */
+static int
+crc32_self_test(crc32_fn fn)
+{
+	uint8_t buf[512 + 16];
+	uint32_t seed = 0x4b4f525a;
+
+	for (size_t i = 0; i < sizeof(buf); i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+
+	for (size_t offset = 0; offset < 16; offset++) {
+		for (size_t size = 0; size <= 512; size += (size < 160) ? 1 : 37) {
+			uint32_t init = ~(uint32_t)(size * 0x9e3779b9);
+
+			if (fn(init, buf + offset, size) !=
+			    crc32_bytes(init, buf + offset, size))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+int
+crc32_set_backend(crc32_backend_t backend)
+{
+	if (backend == CRC32_BACKEND_AUTO) {
+		crc32_init();
+		return 0;
+	}
+
+	crc32_fn fn = crc32_backend_fn(backend);
+	if (!fn || crc32_self_test(fn) != 0)
+		return -1;
+
+	crc32_impl = fn;
+	crc32_backend = backend;
+	return 0;
+}
+
+crc32_backend_t
+crc32_init(void)
+{
+	static const crc32_backend_t preferred[] = {
+		CRC32_BACKEND_ARMV8,
+		CRC32_BACKEND_PCLMUL,
+		CRC32_BACKEND_SLICING_8,
+	};
+
+	for (size_t i = 0; i < sizeof(preferred) / sizeof(preferred[0]); i++) {
+		if (crc32_set_backend(preferred[i]) == 0)
+			return crc32_backend;
+	}
+
+	crc32_impl = crc32_bytewise;
+	crc32_backend = CRC32_BACKEND_BYTEWISE;
+	return crc32_backend;
+}
+
+crc32_backend_t
+crc32_get_backend(void)
+{
+	return crc32_backend;
+}
+
+const char *
+crc32_backend_name(crc32_backend_t backend)
+{
+	if (backend < 0 || backend >= __CRC32_BACKEND_MAX)
+		return "unknown";
+
+	return crc32_backend_names[backend];
+}
+
+static uint32_t
+crc32_dispatch(uint32_t crc, const uint8_t *p, size_t size)
+{
+	crc32_init();
+	return crc32_impl(crc, p, size);
+}
+
+uint32_t crc32(uint32_t crc, const void *buf, size_t size)
+{
+	return ~crc32_impl(~crc, buf, size);
 }
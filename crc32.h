@@ -4,6 +4,57 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+/**
+ * Available CRC32 implementations.
+ */
+typedef enum {
+  // Best implementation available on the running CPU.
+  CRC32_BACKEND_AUTO = 0,
+  // Reference byte-at-a-time implementation using a 256-entry table.
+  CRC32_BACKEND_BYTEWISE,
+  // Bit-at-a-time implementation without any tables.
+  CRC32_BACKEND_BITWISE,
+  // Slicing-by-8 and slicing-by-16 table implementations.
+  CRC32_BACKEND_SLICING_8,
+  CRC32_BACKEND_SLICING_16,
+  // ARMv8 CRC32 instructions.
+  CRC32_BACKEND_ARMV8,
+  // x86 carry-less multiplication folding.
+  CRC32_BACKEND_PCLMUL,
+  __CRC32_BACKEND_MAX,
+} crc32_backend_t;
+
+/**
+ * Selects the fastest CRC32 implementation supported by the running CPU which
+ * passes a self-test against the reference implementation. This is done
+ * automatically on first use, but may be called at startup to avoid doing it
+ * on the first frame.
+ *
+ * @return Selected implementation
+ */
+crc32_backend_t crc32_init(void);
+
+/**
+ * Forces a specific CRC32 implementation.
+ *
+ * @param backend Implementation to use
+ * @return Zero on success, -1 if not supported or the self-test failed
+ */
+int crc32_set_backend(crc32_backend_t backend);
+
+/**
+ * Returns the currently selected CRC32 implementation.
+ */
+crc32_backend_t crc32_get_backend(void);
+
+/**
+ * Returns a human-readable name of a CRC32 implementation.
+ *
+ * @param backend Implementation
+ * @return Implementation name
+ */
+const char *crc32_backend_name(crc32_backend_t backend);
+
 /**
  * Computes the CRC32 checksum over a buffer.
  *
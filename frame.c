@@ -17,16 +17,36 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "frame.h"
+#include "crc32.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 void frame_parser_add_to_frame(parser_t *parser, uint8_t byte);
+void frame_parser_add_run(parser_t *parser, const uint8_t *data, size_t length);
+void frame_parser_handle_byte(parser_t *parser, uint8_t byte);
+void frame_parser_emit(parser_t *parser);
+size_t frame_scan_marker(const uint8_t *buffer, size_t length);
+int frame_template_update(frame_template_t *template);
 
 void frame_parser_init(parser_t *parser)
 {
   parser->handler = NULL;
+  parser->context = NULL;
   parser->state = SERIAL_STATE_WAIT_START;
   parser->length = 0;
+  parser->max_length = FRAME_MAX_LENGTH;
+  parser->timestamp = 0;
+  parser->frame_timestamp = 0;
+  memset(&parser->statistics, 0, sizeof(parser->statistics));
   parser->buffer_size = 1024;
   parser->buffer = (uint8_t*) malloc(parser->buffer_size);
   if (!parser->buffer) {
@@ -35,6 +55,31 @@ void frame_parser_init(parser_t *parser)
   }
 }
 
+void frame_parser_init_fixed(parser_t *parser, size_t max_length)
+{
+  if (max_length < 1) {
+    max_length = 1;
+  } else if (max_length > FRAME_MAX_LENGTH) {
+    max_length = FRAME_MAX_LENGTH;
+  }
+
+  parser->handler = NULL;
+  parser->context = NULL;
+  parser->state = SERIAL_STATE_WAIT_START;
+  parser->length = 0;
+  parser->max_length = max_length;
+  parser->timestamp = 0;
+  parser->frame_timestamp = 0;
+  memset(&parser->statistics, 0, sizeof(parser->statistics));
+  // As the buffer covers the maximum length, it never needs to grow.
+  parser->buffer_size = max_length;
+  parser->buffer = (uint8_t*) malloc(parser->buffer_size);
+  if (!parser->buffer) {
+    // Out of memory abort.
+    abort();
+  }
+}
+
 void frame_parser_free(parser_t *parser)
 {
   parser->state = SERIAL_STATE_WAIT_START;
@@ -45,15 +90,105 @@ void frame_parser_free(parser_t *parser)
 
 void frame_parser_push_buffer(parser_t *parser, uint8_t *buffer, size_t length)
 {
-  for (size_t i = 0; i < length; i++) {
-    frame_parser_push_byte(parser, buffer[i]);
+  size_t i = 0;
+  parser->statistics.bytes += length;
+  while (i < length) {
+    // Outside escapes, only frame markers change the parser state, so runs of
+    // other bytes are either skipped or copied to the frame buffer at once.
+    if (parser->state == SERIAL_STATE_WAIT_START || parser->state == SERIAL_STATE_IN_FRAME) {
+      size_t run = frame_scan_marker(buffer + i, length - i);
+      if (parser->state == SERIAL_STATE_IN_FRAME) {
+        frame_parser_add_run(parser, buffer + i, run);
+      }
+
+      i += run;
+      if (i == length) {
+        break;
+      }
+    }
+
+    frame_parser_handle_byte(parser, buffer[i]);
+    i++;
   }
 }
 
+void frame_parser_push_buffer_at(parser_t *parser, uint8_t *buffer, size_t length, uint64_t timestamp)
+{
+  parser->timestamp = timestamp;
+  frame_parser_push_buffer(parser, buffer, length);
+}
+
+size_t frame_scan_marker(const uint8_t *buffer, size_t length)
+{
+  size_t i = 0;
+
+  // Frame markers are consecutive, so a byte is a marker when its distance
+  // from the start marker is at most two.
+#if defined(__SSE2__)
+  const __m128i base = _mm_set1_epi8((char) FRAME_MARKER_START);
+  const __m128i limit = _mm_set1_epi8(FRAME_MARKER_ESCAPE - FRAME_MARKER_START);
+  for (; i + 16 <= length; i += 16) {
+    __m128i distance = _mm_sub_epi8(_mm_loadu_si128((const __m128i*) (buffer + i)), base);
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(distance, limit), distance));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const uint8x16_t base = vdupq_n_u8(FRAME_MARKER_START);
+  const uint8x16_t limit = vdupq_n_u8(FRAME_MARKER_ESCAPE - FRAME_MARKER_START);
+  for (; i + 16 <= length; i += 16) {
+    uint8x16_t distance = vsubq_u8(vld1q_u8(buffer + i), base);
+    if (vmaxvq_u8(vcleq_u8(distance, limit))) {
+      // Locate the marker within this block below.
+      break;
+    }
+  }
+#endif
+
+  for (; i < length; i++) {
+    if ((uint8_t) (buffer[i] - FRAME_MARKER_START) <= FRAME_MARKER_ESCAPE - FRAME_MARKER_START) {
+      break;
+    }
+  }
+
+  return i;
+}
+
+void frame_parser_add_run(parser_t *parser, const uint8_t *data, size_t length)
+{
+  if (!length) {
+    return;
+  }
+
+  // Adding bytes one by one would resync as soon as the frame grows beyond
+  // the maximum length and ignore the rest of the run while waiting for start.
+  if (length > parser->max_length - parser->length) {
+    parser->statistics.oversized++;
+    parser->state = SERIAL_STATE_WAIT_START;
+    parser->length = 0;
+    return;
+  }
+
+  // Increase buffer when needed, in the same steps as for single bytes.
+  if (parser->length + length > parser->buffer_size) {
+    parser->buffer_size = (parser->length + length + 1023) & ~((size_t) 1023);
+    parser->buffer = (uint8_t*) realloc(parser->buffer, parser->buffer_size);
+    if (!parser->buffer) {
+      // Out of memory abort.
+      abort();
+    }
+  }
+
+  memcpy(parser->buffer + parser->length, data, length);
+  parser->length += length;
+}
+
 void frame_parser_add_to_frame(parser_t *parser, uint8_t byte)
 {
   // If there is already too many bytes in the buffer, discard them and resync.
-  if (parser->length > FRAME_MAX_LENGTH) {
+  if (parser->length >= parser->max_length) {
+    parser->statistics.oversized++;
     parser->state = SERIAL_STATE_WAIT_START;
     parser->length = 0;
     return;
@@ -74,6 +209,51 @@ void frame_parser_add_to_frame(parser_t *parser, uint8_t byte)
 }
 
 void frame_parser_push_byte(parser_t *parser, uint8_t byte)
+{
+  parser->statistics.bytes++;
+  frame_parser_handle_byte(parser, byte);
+}
+
+void frame_parser_emit(parser_t *parser)
+{
+  message_t message;
+  message_result_t result = message_parse_view(&message, parser->buffer, parser->length);
+  if (result == MESSAGE_ERROR_CHECKSUM_MISMATCH) {
+    parser->statistics.checksum_errors++;
+    return;
+  } else if (result != MESSAGE_SUCCESS) {
+    parser->statistics.parse_errors++;
+    return;
+  }
+
+  parser->statistics.frames++;
+  parser->statistics.tlvs += message.length;
+  if (parser->handler == NULL) {
+    return;
+  }
+
+  frame_info_t info;
+  info.first_byte = parser->frame_timestamp;
+  info.last_byte = parser->timestamp;
+  info.context = parser->context;
+
+  uint64_t start = frame_timestamp_now();
+  parser->handler(&message, &info);
+  uint64_t elapsed = frame_timestamp_now() - start;
+  parser->statistics.handler_time += elapsed;
+  if (elapsed > parser->statistics.handler_time_max) {
+    parser->statistics.handler_time_max = elapsed;
+  }
+}
+
+uint64_t frame_timestamp_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void frame_parser_handle_byte(parser_t *parser, uint8_t byte)
 {
   switch (parser->state) {
     case SERIAL_STATE_WAIT_START: {
@@ -82,6 +262,7 @@ void frame_parser_push_byte(parser_t *parser, uint8_t byte)
         parser->state = SERIAL_STATE_WAIT_START_ESCAPE;
       } else if (byte == FRAME_MARKER_START) {
         parser->state = SERIAL_STATE_IN_FRAME;
+        parser->frame_timestamp = parser->timestamp;
       }
       break;
     }
@@ -95,17 +276,12 @@ void frame_parser_push_byte(parser_t *parser, uint8_t byte)
         parser->state = SERIAL_STATE_AFTER_ESCAPE;
       } else if (byte == FRAME_MARKER_START) {
         // Encountered start marker while parsing frame, resynchronize.
+        parser->statistics.resyncs++;
         parser->length = 0;
+        parser->frame_timestamp = parser->timestamp;
       } else if (byte == FRAME_MARKER_END) {
         // End of frame.
-        if (parser->handler != NULL) {
-          message_t message;
-          message_init(&message);
-          if (message_parse(&message, parser->buffer, parser->length) == MESSAGE_SUCCESS) {
-            parser->handler(&message);
-          }
-          message_free(&message);
-        }
+        frame_parser_emit(parser);
 
         parser->length = 0;
         parser->state = SERIAL_STATE_WAIT_START;
@@ -123,47 +299,216 @@ void frame_parser_push_byte(parser_t *parser, uint8_t byte)
   }
 }
 
+static inline void frame_encoder_put(frame_encoder_t *encoder, uint8_t byte)
+{
+  if (encoder->offset + 2 > encoder->length) {
+    encoder->overflow = 1;
+    return;
+  }
+
+  // Escape frame markers.
+  if (byte == FRAME_MARKER_START ||
+      byte == FRAME_MARKER_END ||
+      byte == FRAME_MARKER_ESCAPE) {
+    encoder->frame[encoder->offset++] = FRAME_MARKER_ESCAPE;
+  }
+
+  encoder->frame[encoder->offset++] = byte;
+}
+
+static inline void frame_encoder_put_buffer(frame_encoder_t *encoder, const uint8_t *buffer, size_t length)
+{
+  for (size_t i = 0; i < length; i++) {
+    frame_encoder_put(encoder, buffer[i]);
+  }
+}
+
+void frame_encoder_init(frame_encoder_t *encoder, uint8_t *frame, size_t length)
+{
+  encoder->frame = frame;
+  encoder->length = length;
+  encoder->offset = 0;
+  encoder->checksum = 0;
+  encoder->overflow = 0;
+
+  if (length < 1) {
+    encoder->overflow = 1;
+    return;
+  }
+
+  frame[encoder->offset++] = FRAME_MARKER_START;
+}
+
+void frame_encoder_add_tlv(frame_encoder_t *encoder, uint8_t type, uint16_t length, const uint8_t *value)
+{
+  frame_encoder_put(encoder, type);
+  frame_encoder_put(encoder, length >> 8);
+  frame_encoder_put(encoder, length & 0xFF);
+  frame_encoder_put_buffer(encoder, value, length);
+
+  encoder->checksum = crc32(encoder->checksum, value, length);
+}
+
+void frame_encoder_add_checksum(frame_encoder_t *encoder)
+{
+  uint32_t checksum = htonl(encoder->checksum);
+  frame_encoder_add_tlv(encoder, TLV_CHECKSUM, sizeof(uint32_t), (uint8_t*) &checksum);
+}
+
+ssize_t frame_encoder_finish(frame_encoder_t *encoder)
+{
+  if (encoder->overflow || encoder->offset >= encoder->length) {
+    return -1;
+  }
+
+  encoder->frame[encoder->offset++] = FRAME_MARKER_END;
+  return encoder->offset;
+}
+
+size_t frame_message_max_size(const message_t *message)
+{
+  return 2 + 2 * message_serialized_size(message);
+}
+
 ssize_t frame_message(uint8_t *frame, size_t length, const message_t *message)
 {
-  // First check if there is not enough space in the output buffer. This is
-  // an optimistic estimate (assumes no escaping is needed).
-  size_t buffer_size = message_serialized_size(message);
-  if (length < buffer_size + 2) {
+  frame_encoder_t encoder;
+  frame_encoder_init(&encoder, frame, length);
+  for (size_t i = 0; i < message->length; i++) {
+    frame_encoder_add_tlv(&encoder, message->tlv[i].type, message->tlv[i].length, message->tlv[i].value);
+  }
+
+  return frame_encoder_finish(&encoder);
+}
+
+ssize_t frame_message_checksum(uint8_t *frame, size_t length, const message_t *message)
+{
+  frame_encoder_t encoder;
+  frame_encoder_init(&encoder, frame, length);
+  for (size_t i = 0; i < message->length; i++) {
+    frame_encoder_add_tlv(&encoder, message->tlv[i].type, message->tlv[i].length, message->tlv[i].value);
+  }
+  frame_encoder_add_checksum(&encoder);
+
+  return frame_encoder_finish(&encoder);
+}
+
+int frame_template_update(frame_template_t *template)
+{
+  // Update checksum over the variable TLV value and all TLVs following it.
+  uint32_t checksum = template->prefix_checksum;
+  size_t offset = template->field_offset;
+  uint16_t length = template->field_length;
+  for (;;) {
+    checksum = crc32(checksum, &template->raw[offset], length);
+    offset += length;
+
+    uint8_t type = template->raw[offset];
+    length = (template->raw[offset + 1] << 8) | template->raw[offset + 2];
+    offset += sizeof(uint8_t) + sizeof(uint16_t);
+    if (type == TLV_CHECKSUM) {
+      break;
+    }
+  }
+
+  checksum = htonl(checksum);
+  memcpy(&template->raw[offset], &checksum, sizeof(uint32_t));
+
+  // Re-escape the frame following the constant prefix.
+  frame_encoder_t encoder;
+  encoder.frame = template->frame;
+  encoder.length = sizeof(template->frame);
+  encoder.offset = template->frame_prefix_length;
+  encoder.overflow = 0;
+  frame_encoder_put_buffer(&encoder, &template->raw[template->field_offset],
+                           template->raw_length - template->field_offset);
+
+  ssize_t frame_length = frame_encoder_finish(&encoder);
+  if (frame_length < 0) {
     return -1;
   }
 
-  // Serialize message into buffer.
-  uint8_t *buffer = (uint8_t*) malloc(buffer_size);
-  if (!buffer) {
-    abort();
+  template->frame_length = frame_length;
+  return 0;
+}
+
+int frame_template_init(frame_template_t *template, const message_t *message, uint8_t type)
+{
+  const tlv_t *field = message_tlv_find(message, type);
+  if (!field || message_tlv_find(message, TLV_CHECKSUM) ||
+      message_serialized_size(message) > FRAME_TEMPLATE_MAX_LENGTH) {
+    return -1;
   }
 
-  ssize_t result = message_serialize(buffer, buffer_size, message);
-  if (result != buffer_size) {
-    free(buffer);
+  // Serialize message and locate the variable TLV, computing the checksum over
+  // all values preceding it.
+  ssize_t raw_length = message_serialize(template->raw, sizeof(template->raw), message);
+  if (raw_length < 0) {
     return -1;
   }
 
-  // Frame the message, inserting escape markers when needed.
-  size_t index = 0;
-  frame[index++] = FRAME_MARKER_START;
-  for (size_t i = 0; i < buffer_size; i++) {
-    if (index >= length) {
-      free(buffer);
-      return -1;
+  size_t offset = 0;
+  template->prefix_checksum = 0;
+  for (size_t i = 0; i < message->length; i++) {
+    const tlv_t *tlv = &message->tlv[i];
+    offset += sizeof(uint8_t) + sizeof(uint16_t);
+    if (tlv == field) {
+      template->field_offset = offset;
+      template->field_length = tlv->length;
+      break;
     }
 
-    // Escape frame markers.
-    if (buffer[i] == FRAME_MARKER_START ||
-        buffer[i] == FRAME_MARKER_END ||
-        buffer[i] == FRAME_MARKER_ESCAPE) {
-      frame[index++] = FRAME_MARKER_ESCAPE;
+    template->prefix_checksum = crc32(template->prefix_checksum, tlv->value, tlv->length);
+    offset += tlv->length;
+  }
+
+  // Append checksum TLV, its value is filled in on update.
+  uint8_t *checksum_tlv = &template->raw[raw_length];
+  checksum_tlv[0] = TLV_CHECKSUM;
+  checksum_tlv[1] = 0;
+  checksum_tlv[2] = sizeof(uint32_t);
+  template->raw_length = raw_length + sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint32_t);
+
+  // Frame the constant prefix.
+  frame_encoder_t encoder;
+  frame_encoder_init(&encoder, template->frame, sizeof(template->frame));
+  frame_encoder_put_buffer(&encoder, template->raw, template->field_offset);
+  template->frame_prefix_length = encoder.offset;
+
+  return frame_template_update(template);
+}
+
+int frame_template_patch(frame_template_t *template, const uint8_t *value, size_t length)
+{
+  if (length != template->field_length) {
+    return -1;
+  }
+
+  memcpy(&template->raw[template->field_offset], value, length);
+  return frame_template_update(template);
+}
+
+int frame_template_patch_tlv(frame_template_t *template, uint8_t type, const uint8_t *value, size_t length)
+{
+  size_t offset = template->field_offset - sizeof(uint8_t) - sizeof(uint16_t);
+  while (offset < template->raw_length) {
+    uint8_t tlv_type = template->raw[offset];
+    uint16_t tlv_length = (template->raw[offset + 1] << 8) | template->raw[offset + 2];
+    offset += sizeof(uint8_t) + sizeof(uint16_t);
+
+    if (tlv_type == TLV_CHECKSUM) {
+      break;
+    } else if (tlv_type == type) {
+      if (length != tlv_length) {
+        return -1;
+      }
+
+      memcpy(&template->raw[offset], value, length);
+      return frame_template_update(template);
     }
 
-    frame[index++] = buffer[i];
+    offset += tlv_length;
   }
-  frame[index++] = FRAME_MARKER_END;
 
-  free(buffer);
-  return index;
+  return -1;
 }
@@ -22,10 +22,24 @@
 #include "message.h"
 
 /**
- * Handler for messages received in frames. After the message is handled, it will
- * be freed, so no external references should be kept.
+ * Metadata of a received frame. Timestamps are monotonic (in nanoseconds, see
+ * frame_timestamp_now) and correspond to the buffers that contained the first
+ * and the last byte of the frame when they were pushed to the parser.
  */
-typedef void (*frame_message_handler)(const message_t *message);
+typedef struct {
+  uint64_t first_byte;
+  uint64_t last_byte;
+  // Context of the parser that received the frame.
+  void *context;
+} frame_info_t;
+
+/**
+ * Handler for messages received in frames. TLV values of the message point
+ * directly into the parser's frame buffer and are only valid until the handler
+ * returns, so no external references should be kept. Use message_copy when the
+ * message needs to outlive the handler.
+ */
+typedef void (*frame_message_handler)(const message_t *message, const frame_info_t *info);
 
 /**
  * Parser states.
@@ -41,6 +55,33 @@ typedef enum {
 #define FRAME_MARKER_START 0xF1
 #define FRAME_MARKER_END 0xF2
 #define FRAME_MARKER_ESCAPE 0xF3
+// Worst-case size of a framed checksum TLV.
+#define FRAME_CHECKSUM_MAX_SIZE (2 * (sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint32_t)))
+// Maximum serialized size of a frame template message (excluding checksum).
+#define FRAME_TEMPLATE_MAX_LENGTH 64
+
+/**
+ * Frame parser statistics.
+ */
+typedef struct {
+  // Number of bytes pushed to the parser.
+  uint64_t bytes;
+  // Number of frames that were decoded and passed to the handler.
+  uint64_t frames;
+  // Number of TLVs in decoded frames.
+  uint64_t tlvs;
+  // Number of frames discarded due to a start marker inside a frame.
+  uint64_t resyncs;
+  // Number of frames discarded due to exceeding the maximum length.
+  uint64_t oversized;
+  // Number of frames that could not be parsed as messages.
+  uint64_t parse_errors;
+  // Number of frames with a checksum mismatch.
+  uint64_t checksum_errors;
+  // Total and maximum time spent in the message handler (in nanoseconds).
+  uint64_t handler_time;
+  uint64_t handler_time_max;
+} frame_parser_statistics_t;
 
 /**
  * Frame parser.
@@ -48,14 +89,59 @@ typedef enum {
 typedef struct {
   /// Handler that will be used to emit parsed messages.
   frame_message_handler handler;
+  /// Context passed to the handler in frame metadata.
+  void *context;
 
   // Internal parser state.
   parser_state_t state;
   uint8_t *buffer;
   size_t buffer_size;
   size_t length;
+  // Frames with more content bytes are discarded.
+  size_t max_length;
+  // Timestamp of the buffer currently being pushed and of the current frame start.
+  uint64_t timestamp;
+  uint64_t frame_timestamp;
+
+  /// Parser statistics.
+  frame_parser_statistics_t statistics;
 } parser_t;
 
+/**
+ * Streaming frame encoder. TLVs are serialized, escaped and checksummed in a
+ * single pass directly into the destination buffer.
+ */
+typedef struct {
+  uint8_t *frame;
+  size_t length;
+  size_t offset;
+  // Running checksum over all TLV values encoded so far.
+  uint32_t checksum;
+  // Set when the destination buffer is too small.
+  uint8_t overflow;
+} frame_encoder_t;
+
+/**
+ * Pre-encoded frame of a message where only the value of a single TLV changes
+ * between transmissions. Patching the value only re-escapes the part of the
+ * frame that follows it and updates the checksum.
+ */
+typedef struct {
+  // Serialized message, including the trailing checksum TLV.
+  uint8_t raw[FRAME_TEMPLATE_MAX_LENGTH + sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint32_t)];
+  size_t raw_length;
+  // Location of the variable TLV value in the serialized message.
+  size_t field_offset;
+  uint16_t field_length;
+  // Checksum over all TLV values preceding the variable one.
+  uint32_t prefix_checksum;
+
+  // Framed message, which is constant up to frame_prefix_length.
+  uint8_t frame[2 + 2 * (FRAME_TEMPLATE_MAX_LENGTH + sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint32_t))];
+  size_t frame_prefix_length;
+  size_t frame_length;
+} frame_template_t;
+
 /**
  * Initializes the frame parser.
  *
@@ -63,6 +149,16 @@ typedef struct {
  */
 void frame_parser_init(parser_t *parser);
 
+/**
+ * Initializes the frame parser with a fixed-size frame buffer, which is
+ * allocated once and never grows. Frames longer than the given maximum
+ * length are discarded as soon as they exceed it.
+ *
+ * @param parser Parser instance
+ * @param max_length Maximum length of frame content (capped at FRAME_MAX_LENGTH)
+ */
+void frame_parser_init_fixed(parser_t *parser, size_t max_length);
+
 /**
  * Frees the frame parser.
  *
@@ -79,6 +175,16 @@ void frame_parser_free(parser_t *parser);
  */
 void frame_parser_push_buffer(parser_t *parser, uint8_t *buffer, size_t length);
 
+/**
+ * Pushes a buffer received at the given time to the frame parser.
+ *
+ * @param parser Parser instance
+ * @param buffer Buffer to push
+ * @param length Size of the buffer
+ * @param timestamp Monotonic time of reception (in nanoseconds)
+ */
+void frame_parser_push_buffer_at(parser_t *parser, uint8_t *buffer, size_t length, uint64_t timestamp);
+
 /**
  * Pushes a single byte to the frame parser.
  *
@@ -87,6 +193,54 @@ void frame_parser_push_buffer(parser_t *parser, uint8_t *buffer, size_t length);
  */
 void frame_parser_push_byte(parser_t *parser, uint8_t byte);
 
+/**
+ * Returns the current monotonic time in nanoseconds.
+ */
+uint64_t frame_timestamp_now();
+
+/**
+ * Initializes a frame encoder and emits the frame start marker.
+ *
+ * @param encoder Encoder instance
+ * @param frame Destination buffer
+ * @param length Destination buffer length
+ */
+void frame_encoder_init(frame_encoder_t *encoder, uint8_t *frame, size_t length);
+
+/**
+ * Encodes a raw TLV into the frame.
+ *
+ * @param encoder Encoder instance
+ * @param type TLV type
+ * @param length TLV length
+ * @param value TLV value
+ */
+void frame_encoder_add_tlv(frame_encoder_t *encoder, uint8_t type, uint16_t length, const uint8_t *value);
+
+/**
+ * Encodes a checksum TLV computed over all TLVs encoded so far.
+ *
+ * @param encoder Encoder instance
+ */
+void frame_encoder_add_checksum(frame_encoder_t *encoder);
+
+/**
+ * Emits the frame end marker.
+ *
+ * @param encoder Encoder instance
+ * @return Size of the output frame or -1 if the destination buffer was too small
+ */
+ssize_t frame_encoder_finish(frame_encoder_t *encoder);
+
+/**
+ * Returns the maximum size the given message may take when framed, which is
+ * reached when every serialized byte needs to be escaped.
+ *
+ * @param message Message to frame
+ * @return Worst-case size of the output frame
+ */
+size_t frame_message_max_size(const message_t *message);
+
 /**
  * Frames the given message.
  *
@@ -97,4 +251,51 @@ void frame_parser_push_byte(parser_t *parser, uint8_t byte);
  */
 ssize_t frame_message(uint8_t *frame, size_t length, const message_t *message);
 
+/**
+ * Frames the given message and appends a checksum TLV, which is computed in
+ * the same pass. The message itself should not contain a checksum TLV. The
+ * destination buffer needs at most FRAME_CHECKSUM_MAX_SIZE bytes more than
+ * for frame_message.
+ *
+ * @param frame Destination buffer
+ * @param length Destination buffer length
+ * @param message Message to frame
+ * @return Size of the output frame
+ */
+ssize_t frame_message_checksum(uint8_t *frame, size_t length, const message_t *message);
+
+/**
+ * Prepares a frame template from a message. A checksum TLV is appended to the
+ * message, so it should not already contain one.
+ *
+ * @param template Template instance
+ * @param message Message to pre-encode
+ * @param type Type of the TLV whose value will be patched
+ * @return Zero on success, -1 if the message is too large or has no such TLV
+ */
+int frame_template_init(frame_template_t *template, const message_t *message, uint8_t type);
+
+/**
+ * Replaces the value of the variable TLV and updates the framed message.
+ *
+ * @param template Template instance
+ * @param value New TLV value (in wire format)
+ * @param length Length of the new value, which must match the original
+ * @return Zero on success, -1 on length mismatch
+ */
+int frame_template_patch(frame_template_t *template, const uint8_t *value, size_t length);
+
+/**
+ * Replaces the value of a TLV that follows the variable TLV and updates the
+ * framed message. TLVs preceding the variable TLV are part of the constant
+ * prefix and cannot be patched.
+ *
+ * @param template Template instance
+ * @param type Type of the TLV to patch
+ * @param value New TLV value (in wire format)
+ * @param length Length of the new value, which must match the original
+ * @return Zero on success, -1 if there is no such TLV or on length mismatch
+ */
+int frame_template_patch_tlv(frame_template_t *template, uint8_t type, const uint8_t *value, size_t length);
+
 #endif
@@ -20,6 +20,7 @@
 #include "serial.h"
 #include "gpio.h"
 #include "configuration.h"
+#include "sfp_ddm.h"
 
 #include "rpi_ws281x/ws2811.h"
 
@@ -29,13 +30,33 @@
 #include <libubox/blobmsg.h>
 #include <unistd.h>
 #include <math.h>
+#include <stdint.h>
+#include <arpa/inet.h>
 
 #define MAX_SFP_MODULE_ID_LENGTH 64
 
 #define KORUZA_SFP_REFRESH_INTERVAL 100
+// Time after which an SFP polling cycle is aborted (in milliseconds).
+#define KORUZA_SFP_TIMEOUT 1000
+// Default interval of direct SFP diagnostics reads over I2C (in milliseconds).
+#define KORUZA_SFP_DDM_INTERVAL 10
+// Interval of direct reads while there is no supported module (in milliseconds).
+#define KORUZA_SFP_DDM_RETRY_INTERVAL 1000
 #define KORUZA_REFRESH_INTERVAL 500
 #define KORUZA_MCU_TIMEOUT 2000
 #define KORUZA_MCU_RESET_DELAY 120000
+// Default number of outstanding commands to the motor MCU.
+#define KORUZA_COMMAND_WINDOW 4
+// Default reply timeout (in milliseconds) and number of retries of commands.
+#define KORUZA_COMMAND_TIMEOUT 1000
+#define KORUZA_COMMAND_RETRIES 2
+// Default status report stream intervals (in milliseconds, zero disables streaming).
+#define KORUZA_MOTORS_STREAM_INTERVAL 500
+#define KORUZA_ACCELEROMETER_STREAM_INTERVAL 100
+// Interval at which stream subscriptions are renewed (in milliseconds).
+#define KORUZA_STREAM_RENEWAL_INTERVAL 2000
+// Interval after which subscribing is attempted again when it failed (in milliseconds).
+#define KORUZA_STREAM_RETRY_INTERVAL 60000
 #define KORUZA_SURVEY_INTERVAL 700
 
 #define LED_COUNT 25
@@ -54,8 +75,105 @@ struct uloop_timeout timer_sfp_status;
 struct uloop_timeout timer_survey;
 // Timer for detection when MCU disconnects.
 struct uloop_timeout timer_wait_reply;
+// Timer for request timeouts.
+struct uloop_timeout timer_requests;
 // Survey.
 static struct koruza_survey survey;
+// Pre-encoded status request frame.
+static frame_template_t status_request;
+// Requests sent to the motor and accelerometer MCUs.
+static request_tracker_t motors_requests;
+static request_tracker_t accelerometer_requests;
+// Number of times commands are resent when there is no reply.
+static uint8_t command_retries;
+
+/**
+ * Status report streaming states.
+ */
+enum koruza_stream_state {
+  // Device is polled with status requests.
+  KORUZA_STREAM_POLLING = 0,
+  // Subscription was sent, polling continues until it is acknowledged.
+  KORUZA_STREAM_SUBSCRIBING,
+  // Device streams status reports on its own.
+  KORUZA_STREAM_ACTIVE,
+};
+
+/**
+ * Status report stream of a device.
+ */
+struct koruza_stream {
+  serial_device_t device;
+  enum koruza_stream_state state;
+  // Requested report interval (in milliseconds).
+  uint16_t interval;
+  // Monotonic times of the last subscription and the last received report.
+  uint64_t subscribed;
+  uint64_t last_report;
+  // Power reading carried by the last subscription.
+  uint16_t rx_power;
+  // Set when the device did not acknowledge the subscription.
+  uint8_t unsupported;
+};
+
+static struct koruza_stream motors_stream;
+static struct koruza_stream accelerometer_stream;
+
+/**
+ * SFP polling cycle steps. Each step is one asynchronous request to the SFP
+ * driver, started when the previous one completes.
+ */
+enum koruza_sfp_step {
+  KORUZA_SFP_IDLE = 0,
+  KORUZA_SFP_GET_MODULES,
+  KORUZA_SFP_GET_DIAGNOSTICS,
+  KORUZA_SFP_GET_CALIBRATION,
+};
+
+/**
+ * State of the SFP polling cycle. At most one cycle is in flight.
+ */
+static struct {
+  enum koruza_sfp_step step;
+  struct ubus_request request;
+  struct blob_buf buffer;
+  // Identifier of the SFP driver ubus object, zero when unknown.
+  uint32_t ubus_id;
+  // Module identity and calibration only change when a module is swapped, so
+  // they are cached until an SFP event or a failed cycle.
+  char module_id[MAX_SFP_MODULE_ID_LENGTH];
+  uint8_t module_valid;
+  tlv_sfp_calibration_t calibration;
+  uint8_t calibration_valid;
+  // Set when the module provides calibration data.
+  uint8_t calibration_present;
+  // Set when the last diagnostics reply contained the module.
+  uint8_t diagnostics_valid;
+  // Notifies about SFP driver events.
+  struct ubus_event_handler events;
+  // Aborts a cycle that takes too long.
+  struct uloop_timeout timeout;
+  uint64_t started;
+  struct koruza_sfp_statistics statistics;
+} sfp_cycle;
+
+/**
+ * Direct reader of SFP diagnostics over I2C. When enabled, it provides the
+ * power readings and the SFP driver is only used for module identity and
+ * calibration.
+ */
+static struct {
+  sfp_ddm_reader_t reader;
+  uint8_t enabled;
+  // Set when the last read succeeded.
+  uint8_t valid;
+  int interval;
+  struct uloop_timeout timer;
+} sfp_direct;
+
+// Serial devices of the motors and accelerometer MCUs.
+static serial_device_t motors_device;
+static serial_device_t accelerometer_device;
 
 // LED configuration.
 static ws2811_t led_config = {
@@ -98,10 +216,32 @@ static struct color_map led_color_map[] = {
 };
 
 int koruza_update_sfp();
+int koruza_sfp_request(enum koruza_sfp_step step);
+void koruza_sfp_finish(int result);
+void koruza_sfp_request_complete(struct ubus_request *req, int ret);
+void koruza_timer_sfp_timeout_handler(struct uloop_timeout *timer);
+void koruza_sfp_invalidate();
+int koruza_sfp_direct_init(struct uci_context *uci);
+void koruza_timer_sfp_direct_handler(struct uloop_timeout *timer);
+void koruza_sfp_event_handler(struct ubus_context *ctx, struct ubus_event_handler *ev, const char *type,
+  struct blob_attr *msg);
 int koruza_update_sfp_leds();
 int koruza_uci_commit();
-void koruza_serial_motors_message_handler(const message_t *message);
-void koruza_serial_accelerometer_message_handler(const message_t *message);
+int koruza_send_command(serial_device_t device, message_t *message, tlv_command_t command);
+request_tracker_t *koruza_request_tracker(serial_device_t device);
+int koruza_send_request_frame(void *context, const uint8_t *frame, size_t length);
+void koruza_schedule_requests();
+void koruza_timer_requests_handler(struct uloop_timeout *timer);
+int koruza_subscribe(struct koruza_stream *stream);
+int koruza_update_stream(struct koruza_stream *stream, uint64_t now);
+uint64_t koruza_stream_timeout(const struct koruza_stream *stream);
+void koruza_stream_init(struct koruza_stream *stream, serial_device_t device, const char *location,
+                        int default_interval);
+void koruza_stream_report(struct koruza_stream *stream, const request_t *request, int matched, uint64_t timestamp);
+int koruza_send_status_request(serial_device_t device);
+void koruza_serial_motors_message_handler(const message_t *message, const frame_info_t *info);
+void koruza_serial_accelerometer_message_handler(const message_t *message, const frame_info_t *info);
+void koruza_serial_disconnect_handler(serial_device_t device, void *context);
 void koruza_timer_status_handler(struct uloop_timeout *timer);
 void koruza_timer_sfp_status_handler(struct uloop_timeout *timer);
 void koruza_timer_wait_reply_handler(struct uloop_timeout *timer);
@@ -120,8 +260,30 @@ int koruza_init(struct uci_context *uci, struct ubus_context *ubus)
   koruza_uci = uci;
 
   memset(&status, 0, sizeof(struct koruza_status));
-  serial_set_message_handler(DEVICE_MOTORS, koruza_serial_motors_message_handler);
-  serial_set_message_handler(DEVICE_ACCELEROMETER, koruza_serial_accelerometer_message_handler);
+  motors_device = serial_find_device(SERIAL_ROLE_MOTORS);
+  accelerometer_device = serial_find_device(SERIAL_ROLE_ACCELEROMETER);
+
+  request_tracker_init(&motors_requests, koruza_send_request_frame, (void*) (intptr_t) motors_device,
+    uci_get_int(uci, "koruza.@mcu[0].command_window", KORUZA_COMMAND_WINDOW),
+    uci_get_int(uci, "koruza.@mcu[0].command_timeout", KORUZA_COMMAND_TIMEOUT) * 1000000ULL);
+  // Only status requests are sent to the accelerometer.
+  request_tracker_init(&accelerometer_requests, koruza_send_request_frame, (void*) (intptr_t) accelerometer_device,
+    1, KORUZA_MCU_TIMEOUT * 1000000ULL);
+  command_retries = uci_get_int(uci, "koruza.@mcu[0].command_retries", KORUZA_COMMAND_RETRIES);
+
+  koruza_stream_init(&motors_stream, motors_device, "koruza.@mcu[0].stream_interval",
+    KORUZA_MOTORS_STREAM_INTERVAL);
+  koruza_stream_init(&accelerometer_stream, accelerometer_device, "koruza.@accelerometer[0].stream_interval",
+    KORUZA_ACCELEROMETER_STREAM_INTERVAL);
+  // Other devices are only monitored by the serial layer.
+  if (motors_device != SERIAL_DEVICE_NONE) {
+    serial_set_message_handler(motors_device, koruza_serial_motors_message_handler, NULL);
+    serial_set_disconnect_handler(motors_device, koruza_serial_disconnect_handler, &motors_stream);
+  }
+  if (accelerometer_device != SERIAL_DEVICE_NONE) {
+    serial_set_message_handler(accelerometer_device, koruza_serial_accelerometer_message_handler, NULL);
+    serial_set_disconnect_handler(accelerometer_device, koruza_serial_disconnect_handler, &accelerometer_stream);
+  }
 
   koruza_survey_reset();
 
@@ -199,14 +361,34 @@ int koruza_init(struct uci_context *uci, struct ubus_context *ubus)
     status.motors.y = 0;
   }
 
+  // Prepare status request frame.
+  message_t msg;
+  uint8_t arena[MESSAGE_ARENA_SIZE];
+  message_init_arena(&msg, arena, sizeof(arena));
+  message_tlv_add_command(&msg, COMMAND_GET_STATUS);
+  message_tlv_add_power_reading(&msg, 0);
+  message_tlv_add_sequence(&msg, 0);
+  if (frame_template_init(&status_request, &msg, TLV_POWER_READING) != 0) {
+    syslog(LOG_ERR, "Failed to prepare status request frame.");
+    return -1;
+  }
+  message_free(&msg);
+
   // Setup timer handlers.
   timer_status.cb = koruza_timer_status_handler;
   timer_sfp_status.cb = koruza_timer_sfp_status_handler;
+  sfp_cycle.timeout.cb = koruza_timer_sfp_timeout_handler;
+  sfp_cycle.events.cb = koruza_sfp_event_handler;
+  if (ubus_register_event_handler(ubus, &sfp_cycle.events, "sfp.*") != UBUS_STATUS_OK) {
+    syslog(LOG_WARNING, "Failed to subscribe to SFP events, module changes will not be detected.");
+  }
   timer_wait_reply.cb = koruza_timer_wait_reply_handler;
+  timer_requests.cb = koruza_timer_requests_handler;
   timer_survey.cb = koruza_timer_survey_handler;
   uloop_timeout_set(&timer_status, KORUZA_REFRESH_INTERVAL);
   uloop_timeout_set(&timer_sfp_status, KORUZA_SFP_REFRESH_INTERVAL);
   uloop_timeout_set(&timer_survey, KORUZA_SURVEY_INTERVAL);
+  koruza_sfp_direct_init(uci);
 
   // Initialize LEDs.
   status.leds = uci_get_int(uci, "koruza.leds.status", 1);
@@ -231,22 +413,56 @@ const struct koruza_status *koruza_get_status()
   return &status;
 }
 
+const request_tracker_t *koruza_get_request_tracker(serial_device_t device)
+{
+  return koruza_request_tracker(device);
+}
+
+request_tracker_t *koruza_request_tracker(serial_device_t device)
+{
+  if (device == SERIAL_DEVICE_NONE) {
+    return NULL;
+  } else if (device == motors_device) {
+    return &motors_requests;
+  } else if (device == accelerometer_device) {
+    return &accelerometer_requests;
+  } else {
+    return NULL;
+  }
+}
+
 const struct koruza_survey *koruza_get_survey()
 {
   return &survey;
 }
 
-void koruza_serial_motors_message_handler(const message_t *message)
+void koruza_serial_motors_message_handler(const message_t *message, const frame_info_t *info)
 {
+  // Decode all TLVs in a single pass.
+  message_report_t report;
+  if (message_decode(message, &report) != MESSAGE_SUCCESS) {
+    return;
+  }
+
   // Check if this is a reply or a command message.
-  tlv_reply_t reply = 0;
-  tlv_command_t command = 0;
-  message_tlv_get_reply(message, &reply);
-  message_tlv_get_command(message, &command);
+  tlv_reply_t reply = MESSAGE_REPORT_HAS(&report, REPLY) ? report.reply : 0;
+  tlv_command_t command = MESSAGE_REPORT_HAS(&report, COMMAND) ? report.command : 0;
   if (!reply && !command) {
     return;
   }
 
+  // Match the reply to its request.
+  if (reply) {
+    // Streamed reports carry no sequence number and do not answer any request.
+    request_t request;
+    int matched = 0;
+    if (motors_stream.state != KORUZA_STREAM_ACTIVE || MESSAGE_REPORT_HAS(&report, SEQUENCE)) {
+      matched = request_tracker_complete(&motors_requests, &report, info->last_byte, &request) == 0;
+    }
+    koruza_stream_report(&motors_stream, &request, matched, info->last_byte);
+    koruza_schedule_requests();
+  }
+
   switch (reply) {
     case REPLY_STATUS_REPORT: {
       uloop_timeout_cancel(&timer_wait_reply);
@@ -261,11 +477,11 @@ void koruza_serial_motors_message_handler(const message_t *message)
       }
 
       // Handle motor position report.
-      tlv_motor_position_t position;
-      if (message_tlv_get_motor_position(message, &position) == MESSAGE_SUCCESS) {
-        status.motors.x = position.x;
-        status.motors.y = position.y;
-        status.motors.z = position.z;
+      if (MESSAGE_REPORT_HAS(&report, MOTOR_POSITION)) {
+        status.motors.timestamp = info->last_byte;
+        status.motors.x = report.motor_position.x;
+        status.motors.y = report.motor_position.y;
+        status.motors.z = report.motor_position.z;
 
         // Save stored position (when in range).
         if (status.motors.x >= -status.motors.range_x && status.motors.x <= status.motors.range_x &&
@@ -281,10 +497,9 @@ void koruza_serial_motors_message_handler(const message_t *message)
       }
 
       // Handle encoder value report.
-      tlv_encoder_value_t encoder_value;
-      if (message_tlv_get_encoder_value(message, &encoder_value) == MESSAGE_SUCCESS) {
-        status.motors.encoder_x = encoder_value.x;
-        status.motors.encoder_y = encoder_value.y;
+      if (MESSAGE_REPORT_HAS(&report, ENCODER_VALUE)) {
+        status.motors.encoder_x = report.encoder_value.x;
+        status.motors.encoder_y = report.encoder_value.y;
       }
 
       break;
@@ -292,9 +507,8 @@ void koruza_serial_motors_message_handler(const message_t *message)
 
     case REPLY_ERROR_REPORT: {
       // Parse the error report.
-      tlv_error_report_t error;
-      if (message_tlv_get_error_report(message, &error) == MESSAGE_SUCCESS) {
-        status.errors.code = error.code;
+      if (MESSAGE_REPORT_HAS(&report, ERROR_REPORT)) {
+        status.errors.code = report.error_report.code;
       }
 
       break;
@@ -314,17 +528,33 @@ void koruza_serial_motors_message_handler(const message_t *message)
   }
 }
 
-void koruza_serial_accelerometer_message_handler(const message_t *message)
+void koruza_serial_accelerometer_message_handler(const message_t *message, const frame_info_t *info)
 {
+  // Decode all TLVs in a single pass.
+  message_report_t report;
+  if (message_decode(message, &report) != MESSAGE_SUCCESS) {
+    return;
+  }
+
   // Check if this is a reply or a command message.
-  tlv_reply_t reply = 0;
-  tlv_command_t command = 0;
-  message_tlv_get_reply(message, &reply);
-  message_tlv_get_command(message, &command);
+  tlv_reply_t reply = MESSAGE_REPORT_HAS(&report, REPLY) ? report.reply : 0;
+  tlv_command_t command = MESSAGE_REPORT_HAS(&report, COMMAND) ? report.command : 0;
   if (!reply && !command) {
     return;
   }
 
+  // Match the reply to its request.
+  if (reply) {
+    // Streamed reports carry no sequence number and do not answer any request.
+    request_t request;
+    int matched = 0;
+    if (accelerometer_stream.state != KORUZA_STREAM_ACTIVE || MESSAGE_REPORT_HAS(&report, SEQUENCE)) {
+      matched = request_tracker_complete(&accelerometer_requests, &report, info->last_byte, &request) == 0;
+    }
+    koruza_stream_report(&accelerometer_stream, &request, matched, info->last_byte);
+    koruza_schedule_requests();
+  }
+
   switch (reply) {
     case REPLY_STATUS_REPORT: {
       if (!status.accelerometer.connected) {
@@ -334,18 +564,19 @@ void koruza_serial_accelerometer_message_handler(const message_t *message)
       }
 
       // Handle accelerometer value report.
-      tlv_vibration_value_t vibration_value;
-      if (message_tlv_get_vibration_value(message, &vibration_value) == MESSAGE_SUCCESS) {
+      if (MESSAGE_REPORT_HAS(&report, VIBRATION_VALUE)) {
+        status.accelerometer.timestamp = info->last_byte;
+        const tlv_vibration_value_t *vibration_value = &report.vibration_value;
         for (size_t i = 0; i < 4; i++) {
           koruza_update_accelerometer_statistics_item(&status.accelerometer.x[i],
-                                                      vibration_value.avg_x[i],
-                                                      vibration_value.max_x[i]);
+                                                      vibration_value->avg_x[i],
+                                                      vibration_value->max_x[i]);
           koruza_update_accelerometer_statistics_item(&status.accelerometer.y[i],
-                                                      vibration_value.avg_y[i],
-                                                      vibration_value.max_y[i]);
+                                                      vibration_value->avg_y[i],
+                                                      vibration_value->max_y[i]);
           koruza_update_accelerometer_statistics_item(&status.accelerometer.z[i],
-                                                      vibration_value.avg_z[i],
-                                                      vibration_value.max_z[i]);
+                                                      vibration_value->avg_z[i],
+                                                      vibration_value->max_z[i]);
         }
       }
 
@@ -358,6 +589,21 @@ void koruza_serial_accelerometer_message_handler(const message_t *message)
   }
 }
 
+void koruza_serial_disconnect_handler(serial_device_t device, void *context)
+{
+  // Requests queued for the previous connection are stale once the device is
+  // back, and it has to be subscribed again.
+  struct koruza_stream *stream = (struct koruza_stream*) context;
+  request_tracker_flush(koruza_request_tracker(device));
+  stream->state = KORUZA_STREAM_POLLING;
+
+  if (device == motors_device) {
+    status.motors.connected = 0;
+  } else if (device == accelerometer_device) {
+    status.accelerometer.connected = 0;
+  }
+}
+
 int koruza_restore_motor()
 {
   tlv_motor_position_t position;
@@ -366,11 +612,11 @@ int koruza_restore_motor()
   position.z = status.motors.z;
 
   message_t msg;
-  message_init(&msg);
+  uint8_t arena[MESSAGE_ARENA_SIZE];
+  message_init_arena(&msg, arena, sizeof(arena));
   message_tlv_add_command(&msg, COMMAND_RESTORE_MOTOR);
   message_tlv_add_motor_position(&msg, &position);
-  message_tlv_add_checksum(&msg);
-  serial_send_message(DEVICE_MOTORS, &msg);
+  koruza_send_command(motors_device, &msg, COMMAND_RESTORE_MOTOR);
   message_free(&msg);
   return 0;
 }
@@ -387,11 +633,11 @@ int koruza_move_motor(int32_t x, int32_t y, int32_t z)
   position.z = z;
 
   message_t msg;
-  message_init(&msg);
+  uint8_t arena[MESSAGE_ARENA_SIZE];
+  message_init_arena(&msg, arena, sizeof(arena));
   message_tlv_add_command(&msg, COMMAND_MOVE_MOTOR);
   message_tlv_add_motor_position(&msg, &position);
-  message_tlv_add_checksum(&msg);
-  serial_send_message(DEVICE_MOTORS, &msg);
+  koruza_send_command(motors_device, &msg, COMMAND_MOVE_MOTOR);
   message_free(&msg);
 
   return 0;
@@ -404,10 +650,10 @@ int koruza_homing()
   }
 
   message_t msg;
-  message_init(&msg);
+  uint8_t arena[MESSAGE_ARENA_SIZE];
+  message_init_arena(&msg, arena, sizeof(arena));
   message_tlv_add_command(&msg, COMMAND_HOMING);
-  message_tlv_add_checksum(&msg);
-  serial_send_message(DEVICE_MOTORS, &msg);
+  koruza_send_command(motors_device, &msg, COMMAND_HOMING);
   message_free(&msg);
 
   return 0;
@@ -416,10 +662,13 @@ int koruza_homing()
 int koruza_reboot()
 {
   message_t msg;
-  message_init(&msg);
+  uint8_t arena[MESSAGE_ARENA_SIZE];
+  message_init_arena(&msg, arena, sizeof(arena));
   message_tlv_add_command(&msg, COMMAND_REBOOT);
-  message_tlv_add_checksum(&msg);
-  serial_send_message(DEVICE_MOTORS, &msg);
+  // The MCU drops all outstanding commands when it reboots. Rebooting is not
+  // queued, as it must neither wait behind nor be retried like other commands.
+  request_tracker_flush(&motors_requests);
+  serial_send_message(motors_device, &msg);
   message_free(&msg);
 
   return 0;
@@ -428,10 +677,12 @@ int koruza_reboot()
 int koruza_firmware_upgrade()
 {
   message_t msg;
-  message_init(&msg);
+  uint8_t arena[MESSAGE_ARENA_SIZE];
+  message_init_arena(&msg, arena, sizeof(arena));
   message_tlv_add_command(&msg, COMMAND_FIRMWARE_UPGRADE);
-  message_tlv_add_checksum(&msg);
-  serial_send_message(DEVICE_MOTORS, &msg);
+  // The bootloader takes over and drops all outstanding commands.
+  request_tracker_flush(&motors_requests);
+  serial_send_message(motors_device, &msg);
   message_free(&msg);
 
   return 0;
@@ -500,30 +751,205 @@ int koruza_update_sfp_leds()
 
 int koruza_update_status()
 {
-  // Update data from the SFP driver.
-  koruza_update_sfp();
-  koruza_update_sfp_leds();
+  // SFP data is updated by its own polling cycle, so the status is never
+  // delayed by the SFP driver.
 
-  // Send a status update request via the serial interface.
-  message_t msg;
-  message_init(&msg);
-  message_tlv_add_command(&msg, COMMAND_GET_STATUS);
-  message_tlv_add_power_reading(&msg, status.sfp.rx_power);
-  message_tlv_add_checksum(&msg);
+  // Send a status update request via the serial interface. Only the power
+  // reading changes between requests, so the pre-encoded frame is patched.
+  uint16_t rx_power = htons(status.sfp.rx_power);
+  if (frame_template_patch(&status_request, (uint8_t*) &rx_power, sizeof(rx_power)) != 0) {
+    return -1;
+  }
 
-  if (serial_send_message(DEVICE_MOTORS, &msg) != 0) {
+  uint64_t now = frame_timestamp_now();
+  if (koruza_update_stream(&motors_stream, now) != 0) {
     status.motors.connected = 0;
   }
 
-  if (serial_send_message(DEVICE_ACCELEROMETER, &msg) != 0) {
+  if (koruza_update_stream(&accelerometer_stream, now) != 0) {
     status.accelerometer.connected = 0;
   }
 
-  message_free(&msg);
+  status.motors.streaming = motors_stream.state == KORUZA_STREAM_ACTIVE;
+  status.accelerometer.streaming = accelerometer_stream.state == KORUZA_STREAM_ACTIVE;
 
   return 0;
 }
 
+void koruza_stream_init(struct koruza_stream *stream, serial_device_t device, const char *location,
+                        int default_interval)
+{
+  memset(stream, 0, sizeof(struct koruza_stream));
+  stream->device = device;
+
+  int interval = uci_get_int(koruza_uci, location, default_interval);
+  if (interval < 0 || interval > UINT16_MAX) {
+    syslog(LOG_ERR, "Invalid stream interval %d for serial device %d, defaulting to %d ms.",
+      interval, device, default_interval);
+    interval = default_interval;
+  }
+  stream->interval = interval;
+}
+
+uint64_t koruza_stream_timeout(const struct koruza_stream *stream)
+{
+  // An active stream is considered lost when several reports are missing.
+  uint64_t timeout = KORUZA_MCU_TIMEOUT * 1000000ULL;
+  if (stream->state == KORUZA_STREAM_ACTIVE && 3 * stream->interval * 1000000ULL > timeout) {
+    timeout = 3 * stream->interval * 1000000ULL;
+  }
+
+  return timeout;
+}
+
+int koruza_update_stream(struct koruza_stream *stream, uint64_t now)
+{
+  const request_tracker_t *tracker = koruza_request_tracker(stream->device);
+  if (!tracker) {
+    return -1;
+  }
+
+  // Requests to a device that is not ready would only pile up in the queue.
+  if (!serial_is_ready(stream->device)) {
+    return -1;
+  }
+
+  switch (stream->state) {
+    case KORUZA_STREAM_POLLING: {
+      // Subscribing requires the device to echo sequence numbers, so the
+      // acknowledgement can be matched.
+      if (stream->interval && tracker->sequence_supported &&
+          (!stream->unsupported || now > stream->subscribed + KORUZA_STREAM_RETRY_INTERVAL * 1000000ULL)) {
+        koruza_subscribe(stream);
+      }
+      break;
+    }
+
+    case KORUZA_STREAM_SUBSCRIBING: {
+      if (now > stream->subscribed + KORUZA_MCU_TIMEOUT * 1000000ULL) {
+        syslog(LOG_INFO, "Serial device %d does not support streaming, falling back to polling.", stream->device);
+        stream->state = KORUZA_STREAM_POLLING;
+        stream->unsupported = 1;
+      }
+      break;
+    }
+
+    case KORUZA_STREAM_ACTIVE: {
+      if (now > stream->last_report + koruza_stream_timeout(stream)) {
+        syslog(LOG_WARNING, "Lost status report stream of serial device %d, polling.", stream->device);
+        stream->state = KORUZA_STREAM_POLLING;
+        break;
+      }
+
+      // Renew the subscription, which also carries the current power reading,
+      // so the MCU gets power changes as fast as when polling.
+      if (now > stream->subscribed + KORUZA_STREAM_RENEWAL_INTERVAL * 1000000ULL ||
+          status.sfp.rx_power != stream->rx_power) {
+        return koruza_subscribe(stream) == 0 ? 0 : -1;
+      }
+
+      return 0;
+    }
+  }
+
+  // Poll until the stream is active.
+  return koruza_send_status_request(stream->device);
+}
+
+int koruza_subscribe(struct koruza_stream *stream)
+{
+  message_t msg;
+  uint8_t arena[MESSAGE_ARENA_SIZE];
+  message_init_arena(&msg, arena, sizeof(arena));
+  message_tlv_add_command(&msg, COMMAND_SUBSCRIBE);
+  message_tlv_add_power_reading(&msg, status.sfp.rx_power);
+  message_tlv_add_interval(&msg, stream->interval);
+
+  // Subscriptions are renewed periodically, so they are not retried.
+  int result = request_tracker_submit(koruza_request_tracker(stream->device), &msg, COMMAND_SUBSCRIBE, 0,
+    frame_timestamp_now());
+  message_free(&msg);
+  koruza_schedule_requests();
+
+  stream->subscribed = frame_timestamp_now();
+  stream->rx_power = status.sfp.rx_power;
+  if (stream->state == KORUZA_STREAM_POLLING) {
+    stream->state = KORUZA_STREAM_SUBSCRIBING;
+  }
+
+  return result;
+}
+
+void koruza_stream_report(struct koruza_stream *stream, const request_t *request, int matched, uint64_t timestamp)
+{
+  stream->last_report = timestamp;
+
+  if (matched && request->command == COMMAND_SUBSCRIBE && stream->state != KORUZA_STREAM_ACTIVE) {
+    syslog(LOG_INFO, "Serial device %d is streaming status reports every %u ms.",
+      stream->device, stream->interval);
+    stream->state = KORUZA_STREAM_ACTIVE;
+    stream->unsupported = 0;
+  }
+}
+
+int koruza_send_status_request(serial_device_t device)
+{
+  // Status requests are not retried, as the next one follows shortly.
+  request_tracker_t *tracker = koruza_request_tracker(device);
+  if (!tracker) {
+    return -1;
+  }
+
+  int result = request_tracker_submit_template(tracker, &status_request, COMMAND_GET_STATUS, 0,
+    frame_timestamp_now());
+  koruza_schedule_requests();
+  return result;
+}
+
+int koruza_send_command(serial_device_t device, message_t *message, tlv_command_t command)
+{
+  // Queue the command, it is sent once there is space in the command window.
+  request_tracker_t *tracker = koruza_request_tracker(device);
+  if (!tracker) {
+    return -1;
+  }
+
+  int result = request_tracker_submit(tracker, message, command, command_retries, frame_timestamp_now());
+  koruza_schedule_requests();
+  return result;
+}
+
+int koruza_send_request_frame(void *context, const uint8_t *frame, size_t length)
+{
+  return serial_send_frame((serial_device_t) (intptr_t) context, frame, length);
+}
+
+void koruza_schedule_requests()
+{
+  // Wake up at the earliest request deadline.
+  uint64_t deadline = request_tracker_next_deadline(&motors_requests);
+  uint64_t accelerometer_deadline = request_tracker_next_deadline(&accelerometer_requests);
+  if (!deadline || (accelerometer_deadline && accelerometer_deadline < deadline)) {
+    deadline = accelerometer_deadline;
+  }
+
+  if (!deadline) {
+    uloop_timeout_cancel(&timer_requests);
+    return;
+  }
+
+  uint64_t now = frame_timestamp_now();
+  uloop_timeout_set(&timer_requests, deadline > now ? (deadline - now) / 1000000 + 1 : 0);
+}
+
+void koruza_timer_requests_handler(struct uloop_timeout *timer)
+{
+  uint64_t now = frame_timestamp_now();
+  request_tracker_poll(&motors_requests, now);
+  request_tracker_poll(&accelerometer_requests, now);
+  koruza_schedule_requests();
+}
+
 int koruza_uci_commit()
 {
   struct uci_ptr ptr;
@@ -601,7 +1027,7 @@ static void koruza_sfp_get_module(struct ubus_request *req, int type, struct blo
     const char *bus = blobmsg_get_string(tb[SFP_GET_MODULES_BUS]);
     // TODO: Better way to detect primary module.
     if (strcmp(bus, "/dev/i2c-1") == 0) {
-      strncpy((char*) req->priv, module_id, MAX_SFP_MODULE_ID_LENGTH);
+      strncpy((char*) req->priv, module_id, MAX_SFP_MODULE_ID_LENGTH - 1);
       break;
     }
   }
@@ -646,14 +1072,15 @@ static void koruza_sfp_get_diagnostics(struct ubus_request *req, int type, struc
     blobmsg_parse(sfp_diagnostics_item_policy, __SFP_DIAG_ITEM_MAX, tb_value,
       blobmsg_data(tb[SFP_GET_DIAG_VALUE]), blobmsg_data_len(tb[SFP_GET_DIAG_VALUE]));
 
-    if (tb_value[SFP_DIAG_ITEM_TX_POWER]) {
+    // Power readings of the direct reader take precedence.
+    if (tb_value[SFP_DIAG_ITEM_TX_POWER] && !sfp_direct.valid) {
       const char *tx_power = blobmsg_get_string(tb_value[SFP_DIAG_ITEM_TX_POWER]);
       float tx_power_float = 0;
       sscanf(tx_power, "%f", &tx_power_float);
       status.sfp.tx_power = (uint16_t) (tx_power_float * 10000);
     }
 
-    if (tb_value[SFP_DIAG_ITEM_RX_POWER]) {
+    if (tb_value[SFP_DIAG_ITEM_RX_POWER] && !sfp_direct.valid) {
       const char *rx_power = blobmsg_get_string(tb_value[SFP_DIAG_ITEM_RX_POWER]);
       float rx_power_float = 0;
       sscanf(rx_power, "%f", &rx_power_float);
@@ -661,6 +1088,7 @@ static void koruza_sfp_get_diagnostics(struct ubus_request *req, int type, struc
     }
 
     // Only process the first module.
+    sfp_cycle.diagnostics_valid = 1;
     break;
   }
 }
@@ -686,11 +1114,11 @@ static void koruza_sfp_get_calibration_data(struct ubus_request *req, int type,
   uint8_t *vendor_specific = (uint8_t*) blobmsg_data(tb[SFP_VENDOR_DATA]);
   size_t vendor_specific_length = blobmsg_data_len(tb[SFP_VENDOR_DATA]);
 
-  // Assume the calibration data contains TLVs.
+  // Assume the calibration data contains TLVs. The reply is only needed while
+  // this handler runs, so the TLVs can be borrowed from it.
   message_t calibration_msg;
   tlv_sfp_calibration_t calibration;
-  message_init(&calibration_msg);
-  if (message_parse(&calibration_msg, vendor_specific, vendor_specific_length) != MESSAGE_SUCCESS) {
+  if (message_parse_view(&calibration_msg, vendor_specific, vendor_specific_length) != MESSAGE_SUCCESS) {
     return;
   }
 
@@ -699,87 +1127,286 @@ static void koruza_sfp_get_calibration_data(struct ubus_request *req, int type,
     return;
   }
 
-  status.camera_calibration.offset_x = calibration.offset_x;
-  status.camera_calibration.offset_y = calibration.offset_y;
+  sfp_cycle.calibration = calibration;
+  sfp_cycle.calibration_present = 1;
 
   message_free(&calibration_msg);
 }
 
 int koruza_update_sfp()
 {
-  uint32_t ubus_id;
-  if (ubus_lookup_id(koruza_ubus, "sfp", &ubus_id)) {
+  if (sfp_direct.valid && sfp_cycle.module_valid && sfp_cycle.calibration_valid) {
+    // Power readings come from the direct reader and everything else is
+    // cached, so the SFP driver is not needed.
+    koruza_update_sfp_leds();
+    return 0;
+  }
+
+  if (sfp_cycle.step != KORUZA_SFP_IDLE) {
+    // The previous cycle is still in flight.
+    sfp_cycle.statistics.skipped++;
+    return -1;
+  }
+
+  if (!sfp_cycle.ubus_id && ubus_lookup_id(koruza_ubus, "sfp", &sfp_cycle.ubus_id)) {
     // The SFP driver does not seem to be running.
+    sfp_cycle.ubus_id = 0;
     return -1;
   }
 
-  static struct blob_buf req;
-
-  // Fetch a list of modules and get the first identifier of the module on bus /dev/i2c-0.
-  char module_id[MAX_SFP_MODULE_ID_LENGTH] = {0,};
-  blob_buf_init(&req, 0);
-  if (ubus_invoke(
-        koruza_ubus,
-        ubus_id,
-        "get_modules",
-        req.head,
-        koruza_sfp_get_module,
-        &module_id,
-        1000
-      ) != UBUS_STATUS_OK) {
+  sfp_cycle.started = frame_timestamp_now();
+  sfp_cycle.statistics.cycles++;
+  uloop_timeout_set(&sfp_cycle.timeout, KORUZA_SFP_TIMEOUT);
+
+  // Usually only diagnostics need to be fetched. Otherwise fetch a list of
+  // modules first and get the identifier of the module on bus /dev/i2c-1.
+  enum koruza_sfp_step step = KORUZA_SFP_GET_DIAGNOSTICS;
+  if (!sfp_cycle.module_valid) {
+    memset(sfp_cycle.module_id, 0, sizeof(sfp_cycle.module_id));
+    step = KORUZA_SFP_GET_MODULES;
+  }
+
+  sfp_cycle.diagnostics_valid = 0;
+  if (koruza_sfp_request(step) != 0) {
+    koruza_sfp_finish(-1);
     return -1;
   }
 
-  // Get diagnostic data for this module.
-  blob_buf_init(&req, 0);
-  blobmsg_add_string(&req, "module", module_id);
-  if (ubus_invoke(
-        koruza_ubus,
-        ubus_id,
-        "get_diagnostics",
-        req.head,
-        koruza_sfp_get_diagnostics,
-        NULL,
-        1000
-      ) != UBUS_STATUS_OK) {
+  return 0;
+}
+
+int koruza_sfp_request(enum koruza_sfp_step step)
+{
+  const char *method;
+  ubus_data_handler_t handler;
+
+  blob_buf_init(&sfp_cycle.buffer, 0);
+  switch (step) {
+    case KORUZA_SFP_GET_MODULES: {
+      method = "get_modules";
+      handler = koruza_sfp_get_module;
+      break;
+    }
+
+    case KORUZA_SFP_GET_DIAGNOSTICS: {
+      // Get diagnostic data for this module.
+      method = "get_diagnostics";
+      handler = koruza_sfp_get_diagnostics;
+      blobmsg_add_string(&sfp_cycle.buffer, "module", sfp_cycle.module_id);
+      break;
+    }
+
+    case KORUZA_SFP_GET_CALIBRATION: {
+      // Now get vendor-specific data for this module.
+      method = "get_vendor_specific_data";
+      handler = koruza_sfp_get_calibration_data;
+      sfp_cycle.calibration_present = 0;
+      blobmsg_add_string(&sfp_cycle.buffer, "module", sfp_cycle.module_id);
+      break;
+    }
+
+    default: return -1;
+  }
+
+  if (ubus_invoke_async(koruza_ubus, sfp_cycle.ubus_id, method, sfp_cycle.buffer.head,
+        &sfp_cycle.request) != UBUS_STATUS_OK) {
     return -1;
   }
 
-  // Now get vendor-specific data for this module.
-  blob_buf_init(&req, 0);
-  blobmsg_add_string(&req, "module", module_id);
-  if (ubus_invoke(
-        koruza_ubus,
-        ubus_id,
-        "get_vendor_specific_data",
-        req.head,
-        koruza_sfp_get_calibration_data,
-        NULL,
-        1000
-      ) != UBUS_STATUS_OK) {
+  sfp_cycle.step = step;
+  sfp_cycle.request.data_cb = handler;
+  sfp_cycle.request.complete_cb = koruza_sfp_request_complete;
+  sfp_cycle.request.priv = sfp_cycle.module_id;
+  ubus_complete_request_async(koruza_ubus, &sfp_cycle.request);
+  return 0;
+}
+
+void koruza_sfp_request_complete(struct ubus_request *req, int ret)
+{
+  if (ret != UBUS_STATUS_OK) {
+    koruza_sfp_finish(-1);
+    return;
+  }
+
+  switch (sfp_cycle.step) {
+    case KORUZA_SFP_GET_MODULES: {
+      sfp_cycle.module_valid = sfp_cycle.module_id[0] != 0;
+      if (!sfp_cycle.module_valid || koruza_sfp_request(KORUZA_SFP_GET_DIAGNOSTICS) != 0) {
+        koruza_sfp_finish(-1);
+      }
+      break;
+    }
+
+    case KORUZA_SFP_GET_DIAGNOSTICS: {
+      // A module that is no longer present invalidates the cache.
+      if (!sfp_cycle.diagnostics_valid) {
+        koruza_sfp_finish(-1);
+      } else if (sfp_cycle.calibration_valid) {
+        koruza_sfp_finish(0);
+      } else if (koruza_sfp_request(KORUZA_SFP_GET_CALIBRATION) != 0) {
+        koruza_sfp_finish(-1);
+      }
+      break;
+    }
+
+    case KORUZA_SFP_GET_CALIBRATION: {
+      // Modules without calibration data are not asked again either, unless
+      // the module changed while the request was in flight.
+      sfp_cycle.calibration_valid = sfp_cycle.module_valid;
+      koruza_sfp_finish(0);
+      break;
+    }
+
+    default: {
+      koruza_sfp_finish(0);
+    }
+  }
+}
+
+void koruza_sfp_finish(int result)
+{
+  uloop_timeout_cancel(&sfp_cycle.timeout);
+  sfp_cycle.step = KORUZA_SFP_IDLE;
+
+  if (result != 0) {
+    sfp_cycle.statistics.failed++;
+    // Look up the driver again, as it may have been restarted, and the module
+    // may have been swapped.
+    sfp_cycle.ubus_id = 0;
+    koruza_sfp_invalidate();
+    return;
+  }
+
+  sfp_cycle.statistics.last_cycle_time = frame_timestamp_now() - sfp_cycle.started;
+
+  // Calibration stored in the module takes precedence.
+  if (sfp_cycle.calibration_present) {
+    status.camera_calibration.offset_x = sfp_cycle.calibration.offset_x;
+    status.camera_calibration.offset_y = sfp_cycle.calibration.offset_y;
+  }
+
+  koruza_update_sfp_leds();
+}
+
+void koruza_timer_sfp_timeout_handler(struct uloop_timeout *timer)
+{
+  (void) timer;
+
+  if (sfp_cycle.step == KORUZA_SFP_IDLE) {
+    return;
+  }
+
+  syslog(LOG_WARNING, "SFP driver did not reply in time, aborting request.");
+  ubus_abort_request(koruza_ubus, &sfp_cycle.request);
+  sfp_cycle.statistics.aborted++;
+  koruza_sfp_finish(-1);
+}
+
+void koruza_sfp_invalidate()
+{
+  sfp_cycle.module_valid = 0;
+  sfp_cycle.calibration_valid = 0;
+  sfp_cycle.calibration_present = 0;
+}
+
+void koruza_sfp_event_handler(struct ubus_context *ctx, struct ubus_event_handler *ev, const char *type,
+  struct blob_attr *msg)
+{
+  // Any event from the SFP driver (e.g. module hotplug) may change the module.
+  if (sfp_cycle.module_valid) {
+    syslog(LOG_INFO, "Received SFP event '%s', refreshing module information.", type);
+  }
+  koruza_sfp_invalidate();
+  sfp_cycle.statistics.invalidations++;
+}
+
+int koruza_sfp_direct_init(struct uci_context *uci)
+{
+  char *backend = uci_get_string(uci, "koruza.@sfp[0].backend");
+  int enabled = backend && strcmp(backend, "i2c") == 0;
+  free(backend);
+  if (!enabled) {
+    return 0;
+  }
+
+  char *bus = uci_get_string(uci, "koruza.@sfp[0].bus");
+  const char *device = bus ? bus : "/dev/i2c-1";
+  if (sfp_ddm_open(&sfp_direct.reader, device) != 0) {
+    syslog(LOG_WARNING, "Failed to open I2C bus '%s', using the SFP driver instead.", device);
+    free(bus);
     return -1;
   }
 
+  free(bus);
+
+  sfp_direct.interval = uci_get_int(uci, "koruza.@sfp[0].interval", KORUZA_SFP_DDM_INTERVAL);
+  if (sfp_direct.interval <= 0) {
+    sfp_direct.interval = KORUZA_SFP_DDM_INTERVAL;
+  }
+
+  sfp_direct.enabled = 1;
+  sfp_direct.timer.cb = koruza_timer_sfp_direct_handler;
+  uloop_timeout_set(&sfp_direct.timer, sfp_direct.interval);
   return 0;
 }
 
+void koruza_timer_sfp_direct_handler(struct uloop_timeout *timer)
+{
+  uint64_t started = frame_timestamp_now();
+  sfp_ddm_t ddm;
+  if (sfp_ddm_read(&sfp_direct.reader, &ddm) == 0) {
+    if (!sfp_direct.valid) {
+      syslog(LOG_INFO, "Reading SFP diagnostics directly over I2C.");
+    }
+
+    status.sfp.tx_power = ddm.tx_power;
+    status.sfp.rx_power = ddm.rx_power;
+    sfp_direct.valid = 1;
+    sfp_cycle.statistics.direct_reads++;
+    sfp_cycle.statistics.last_direct_read_time = frame_timestamp_now() - started;
+    uloop_timeout_set(timer, sfp_direct.interval);
+    return;
+  }
+
+  // The module was removed or does not support internally calibrated
+  // diagnostics. The SFP driver provides readings until reads succeed again.
+  if (sfp_direct.valid) {
+    syslog(LOG_WARNING, "Failed to read SFP diagnostics over I2C, using the SFP driver instead.");
+  }
+
+  sfp_direct.valid = 0;
+  sfp_cycle.statistics.direct_errors++;
+  uloop_timeout_set(timer, KORUZA_SFP_DDM_RETRY_INTERVAL);
+}
+
+const struct koruza_sfp_statistics *koruza_get_sfp_statistics()
+{
+  return &sfp_cycle.statistics;
+}
+
 void koruza_timer_status_handler(struct uloop_timeout *timer)
 {
   (void) timer;
 
+  // Send requests that could not be sent before.
+  uint64_t now = frame_timestamp_now();
+  request_tracker_poll(&motors_requests, now);
+  request_tracker_poll(&accelerometer_requests, now);
+
   koruza_update_status();
 
   uloop_timeout_set(&timer_status, KORUZA_REFRESH_INTERVAL);
 
+  // Streamed reports may be further apart than polled ones.
   if (!timer_wait_reply.pending)
-    uloop_timeout_set(&timer_wait_reply, KORUZA_MCU_TIMEOUT);
+    uloop_timeout_set(&timer_wait_reply, koruza_stream_timeout(&motors_stream) / 1000000);
 }
 
 void koruza_timer_sfp_status_handler(struct uloop_timeout *timer)
 {
-  // Update data from the SFP driver.
+  // Start a new cycle of requests to the SFP driver, LEDs are updated when
+  // it completes.
   koruza_update_sfp();
-  koruza_update_sfp_leds();
 
   uloop_timeout_set(timer, KORUZA_SFP_REFRESH_INTERVAL);
 }
@@ -790,8 +1417,18 @@ void koruza_timer_wait_reply_handler(struct uloop_timeout *timer)
     return;
   }
 
+  // The stream may have become active after the timer was armed.
+  uint64_t now = frame_timestamp_now();
+  uint64_t deadline = motors_stream.last_report + koruza_stream_timeout(&motors_stream);
+  if (motors_stream.state == KORUZA_STREAM_ACTIVE && now < deadline) {
+    uloop_timeout_set(timer, (deadline - now) / 1000000 + 1);
+    return;
+  }
+
   syslog(LOG_WARNING, "KORUZA motor driver has been disconnected.");
   status.motors.connected = 0;
+  request_tracker_flush(&motors_requests);
+  motors_stream.state = KORUZA_STREAM_POLLING;
 }
 
 void koruza_survey_reset()
@@ -22,6 +22,9 @@
 #include <uci.h>
 #include <libubus.h>
 
+#include "serial.h"
+#include "request.h"
+
 // Survey resolution (number of bins in each direction).
 #define SURVEY_BINS 100
 // Survey coverage (motor coordinate distance from center to edge of survey).
@@ -47,6 +50,10 @@ struct accelerometer_statistics_item {
 
 struct koruza_motor_status {
   uint8_t connected;
+  // Set when the MCU streams status reports instead of being polled.
+  uint8_t streaming;
+  // Monotonic time of the last position report (in nanoseconds).
+  uint64_t timestamp;
 
   int32_t x;
   int32_t y;
@@ -84,8 +91,31 @@ struct koruza_sfp_status {
   uint16_t rx_power;
 };
 
+struct koruza_sfp_statistics {
+  // Number of started polling cycles.
+  uint64_t cycles;
+  // Number of cycles skipped because the previous one was still in flight.
+  uint64_t skipped;
+  // Number of failed cycles and of those, cycles aborted due to a timeout.
+  uint64_t failed;
+  uint64_t aborted;
+  // Duration of the last successful cycle (in nanoseconds).
+  uint64_t last_cycle_time;
+  // Number of times cached module information was invalidated by SFP events.
+  uint64_t invalidations;
+  // Number of successful and failed direct diagnostics reads over I2C.
+  uint64_t direct_reads;
+  uint64_t direct_errors;
+  // Duration of the last successful direct read (in nanoseconds).
+  uint64_t last_direct_read_time;
+};
+
 struct koruza_accelerometer_status {
   uint8_t connected;
+  // Set when the MCU streams status reports instead of being polled.
+  uint8_t streaming;
+  // Monotonic time of the last vibration report (in nanoseconds).
+  uint64_t timestamp;
 
   struct accelerometer_statistics_item x[4];
   struct accelerometer_statistics_item y[4];
@@ -131,6 +161,8 @@ int koruza_set_webcam_calibration(uint32_t offset_x, uint32_t offset_y);
 int koruza_set_distance(uint32_t distance);
 void koruza_set_leds(uint8_t leds);
 const struct koruza_status *koruza_get_status();
+const request_tracker_t *koruza_get_request_tracker(serial_device_t device);
+const struct koruza_sfp_statistics *koruza_get_sfp_statistics();
 
 void koruza_survey_reset();
 const struct koruza_survey *koruza_get_survey();
@@ -26,6 +26,7 @@
 #include <sys/types.h>
 #include <stdlib.h>
 
+#include "crc32.h"
 #include "serial.h"
 #include "koruza.h"
 #include "ubus.h"
@@ -61,6 +62,9 @@ int main(int argc, char **argv)
 
   umask(0077);
 
+  // Select the CRC32 implementation before any frames are processed.
+  syslog(LOG_INFO, "Using %s CRC32 implementation.", crc32_backend_name(crc32_init()));
+
   // Setup signal handlers.
   signal(SIGPIPE, SIG_IGN);
 
@@ -23,10 +23,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <arpa/inet.h>
-#include <assert.h>
 
 // Forward declarations.
 uint32_t message_checksum(const message_t *message);
+message_result_t message_parse_storage(message_t *message, const uint8_t *data, size_t length,
+                                       message_storage_t storage);
+void message_index_tlv(message_t *message, size_t i);
+message_result_t message_tlv_reserve(message_t *message, uint8_t type, uint16_t length, uint8_t **value);
 
 message_result_t message_init(message_t *message)
 {
@@ -34,20 +37,55 @@ message_result_t message_init(message_t *message)
   return MESSAGE_SUCCESS;
 }
 
+message_result_t message_init_arena(message_t *message, uint8_t *arena, size_t size)
+{
+  message_init(message);
+  message->storage = MESSAGE_STORAGE_ARENA;
+  message->arena = arena;
+  message->arena_size = size;
+  return MESSAGE_SUCCESS;
+}
+
 void message_free(message_t *message)
 {
-  for (size_t i = 0; i < message->length; i++) {
-    free(message->tlv[i].value);
+  switch (message->storage) {
+    case MESSAGE_STORAGE_HEAP: {
+      for (size_t i = 0; i < message->length; i++) {
+        free(message->tlv[i].value);
+      }
+      break;
+    }
+    case MESSAGE_STORAGE_ARENA: {
+      message->length = 0;
+      message->arena_used = 0;
+      memset(message->index, 0, sizeof(message->index));
+      memset(message->duplicates, 0, sizeof(message->duplicates));
+      return;
+    }
+    default: break;
   }
 
   message_init(message);
 }
 
 message_result_t message_parse(message_t *message, const uint8_t *data, size_t length)
+{
+  return message_parse_storage(message, data, length, MESSAGE_STORAGE_HEAP);
+}
+
+message_result_t message_parse_view(message_t *message, const uint8_t *data, size_t length)
+{
+  return message_parse_storage(message, data, length, MESSAGE_STORAGE_BORROWED);
+}
+
+message_result_t message_parse_storage(message_t *message, const uint8_t *data, size_t length,
+                                       message_storage_t storage)
 {
   message_init(message);
+  message->storage = storage;
 
   size_t offset = 0;
+  uint32_t checksum = 0;
   while (offset < length) {
     if (message->length >= MAX_TLV_COUNT) {
       message_free(message);
@@ -75,120 +113,290 @@ message_result_t message_parse(message_t *message, const uint8_t *data, size_t l
       return MESSAGE_ERROR_PARSE_ERROR;
     }
 
-    // Parse value.
-    message->tlv[i].value = (uint8_t*) malloc(message->tlv[i].length);
-    if (!message->tlv[i].value) {
-      message_free(message);
-      return MESSAGE_ERROR_OUT_OF_MEMORY;
+    // If this is a checksum TLV, verify it against the running checksum of all
+    // previous TLV values.
+    if (message->tlv[i].type == TLV_CHECKSUM) {
+      uint32_t expected = htonl(checksum);
+      if (message->tlv[i].length != sizeof(uint32_t) ||
+          memcmp(&expected, &data[offset], sizeof(uint32_t)) != 0) {
+        message_free(message);
+        return MESSAGE_ERROR_CHECKSUM_MISMATCH;
+      }
     }
 
-    memcpy(message->tlv[i].value, &data[offset], message->tlv[i].length);
-    offset += message->tlv[i].length;
+    checksum = crc32(checksum, &data[offset], message->tlv[i].length);
 
-    // If this is a checksum TLV, do checksum verification immediately.
-    if (message->tlv[i].type == TLV_CHECKSUM) {
-      uint32_t checksum = message_checksum(message);
-      if (memcmp(&checksum, message->tlv[i].value, sizeof(uint32_t) != 0)) {
+    // Parse value.
+    if (storage == MESSAGE_STORAGE_BORROWED) {
+      message->tlv[i].value = (uint8_t*) &data[offset];
+    } else {
+      message->tlv[i].value = (uint8_t*) malloc(message->tlv[i].length);
+      if (!message->tlv[i].value) {
         message_free(message);
-        return MESSAGE_ERROR_CHECKSUM_MISMATCH;
+        return MESSAGE_ERROR_OUT_OF_MEMORY;
       }
+
+      memcpy(message->tlv[i].value, &data[offset], message->tlv[i].length);
     }
+    offset += message->tlv[i].length;
 
+    message_index_tlv(message, i);
     message->length++;
   }
 
   return MESSAGE_SUCCESS;
 }
 
-message_result_t message_tlv_add(message_t *message, uint8_t type, uint16_t length, const uint8_t *value)
+message_result_t message_verify(const uint8_t *data, size_t length)
 {
+  size_t offset = 0;
+  size_t count = 0;
+  uint32_t checksum = 0;
+  while (offset < length) {
+    if (count >= MAX_TLV_COUNT) {
+      return MESSAGE_ERROR_TOO_MANY_TLVS;
+    }
+
+    uint8_t type = data[offset];
+    offset += sizeof(uint8_t);
+
+    if (offset + sizeof(uint16_t) > length) {
+      return MESSAGE_ERROR_PARSE_ERROR;
+    }
+
+    uint16_t tlv_length = (data[offset] << 8) | data[offset + 1];
+    offset += sizeof(uint16_t);
+
+    if (offset + tlv_length > length) {
+      return MESSAGE_ERROR_PARSE_ERROR;
+    }
+
+    if (type == TLV_CHECKSUM) {
+      uint32_t expected = htonl(checksum);
+      if (tlv_length != sizeof(uint32_t) || memcmp(&expected, &data[offset], sizeof(uint32_t)) != 0) {
+        return MESSAGE_ERROR_CHECKSUM_MISMATCH;
+      }
+    }
+
+    checksum = crc32(checksum, &data[offset], tlv_length);
+    offset += tlv_length;
+    count++;
+  }
+
+  return MESSAGE_SUCCESS;
+}
+
+void message_index_tlv(message_t *message, size_t i)
+{
+  uint8_t type = message->tlv[i].type;
+  if (!message->index[type]) {
+    message->index[type] = i + 1;
+  } else {
+    message->duplicates[type / 8] |= 1 << (type % 8);
+  }
+}
+
+message_result_t message_copy(message_t *destination, const message_t *source)
+{
+  message_init(destination);
+
+  for (size_t i = 0; i < source->length; i++) {
+    message_result_t result = message_tlv_add(destination, source->tlv[i].type, source->tlv[i].length,
+                                              source->tlv[i].value);
+    if (result != MESSAGE_SUCCESS) {
+      message_free(destination);
+      return result;
+    }
+  }
+
+  return MESSAGE_SUCCESS;
+}
+
+message_result_t message_tlv_reserve(message_t *message, uint8_t type, uint16_t length, uint8_t **value)
+{
+  if (message->storage == MESSAGE_STORAGE_BORROWED) {
+    return MESSAGE_ERROR_READ_ONLY;
+  }
+
   if (message->length >= MAX_TLV_COUNT) {
     return MESSAGE_ERROR_TOO_MANY_TLVS;
   }
 
   size_t i = message->length;
-  message->tlv[i].value = (uint8_t*) malloc(length);
-  if (!message->tlv[i].value) {
-    return MESSAGE_ERROR_OUT_OF_MEMORY;
+  if (message->storage == MESSAGE_STORAGE_ARENA) {
+    if (length > message->arena_size - message->arena_used) {
+      return MESSAGE_ERROR_BUFFER_TOO_SMALL;
+    }
+
+    message->tlv[i].value = message->arena + message->arena_used;
+    message->arena_used += length;
+  } else {
+    message->tlv[i].value = (uint8_t*) malloc(length);
+    if (!message->tlv[i].value) {
+      return MESSAGE_ERROR_OUT_OF_MEMORY;
+    }
   }
 
   message->tlv[i].type = type;
   message->tlv[i].length = length;
-  memcpy(message->tlv[i].value, value, length);
+  message_index_tlv(message, i);
   message->length++;
 
+  *value = message->tlv[i].value;
   return MESSAGE_SUCCESS;
 }
 
+message_result_t message_tlv_add(message_t *message, uint8_t type, uint16_t length, const uint8_t *value)
+{
+  uint8_t *destination;
+  message_result_t result = message_tlv_reserve(message, type, length, &destination);
+  if (result != MESSAGE_SUCCESS) {
+    return result;
+  }
+
+  memcpy(destination, value, length);
+  return MESSAGE_SUCCESS;
+}
+
+/**
+ * Converts a value consisting of words of the given width from host to network
+ * byte order. The width is a constant at every call site, so the branches are
+ * resolved at compile time.
+ */
+static inline void message_encode_words(uint8_t *destination, const void *source, size_t size, size_t width)
+{
+  const uint8_t *src = (const uint8_t*) source;
+  for (size_t i = 0; i < size; i += width) {
+    if (width == sizeof(uint32_t)) {
+      uint32_t word;
+      memcpy(&word, &src[i], sizeof(word));
+      word = htonl(word);
+      memcpy(&destination[i], &word, sizeof(word));
+    } else if (width == sizeof(uint16_t)) {
+      uint16_t word;
+      memcpy(&word, &src[i], sizeof(word));
+      word = htons(word);
+      memcpy(&destination[i], &word, sizeof(word));
+    } else {
+      destination[i] = src[i];
+    }
+  }
+}
+
+/**
+ * Converts a value consisting of words of the given width from network to host
+ * byte order.
+ */
+static inline void message_decode_words(void *destination, const uint8_t *source, size_t size, size_t width)
+{
+  uint8_t *dst = (uint8_t*) destination;
+  for (size_t i = 0; i < size; i += width) {
+    if (width == sizeof(uint32_t)) {
+      uint32_t word;
+      memcpy(&word, &source[i], sizeof(word));
+      word = ntohl(word);
+      memcpy(&dst[i], &word, sizeof(word));
+    } else if (width == sizeof(uint16_t)) {
+      uint16_t word;
+      memcpy(&word, &source[i], sizeof(word));
+      word = ntohs(word);
+      memcpy(&dst[i], &word, sizeof(word));
+    } else {
+      dst[i] = source[i];
+    }
+  }
+}
+
+// Wire size of each TLV type defined in the schema (zero for other types).
+static const uint16_t message_tlv_size[256] = {
+#define MESSAGE_TLV_SIZE(name, NAME, type, width) [TLV_##NAME] = sizeof(type),
+  MESSAGE_TLV_SCHEMA(MESSAGE_TLV_SIZE)
+#undef MESSAGE_TLV_SIZE
+  [TLV_CHECKSUM] = sizeof(uint32_t),
+};
+
+// Typed encoders and decoders for all TLVs defined in the schema.
+#define MESSAGE_TLV_CODEC(name, NAME, type, width) \
+  static inline message_result_t message_tlv_put_##name(message_t *message, const type *value) \
+  { \
+    uint8_t *destination; \
+    message_result_t result = message_tlv_reserve(message, TLV_##NAME, sizeof(type), &destination); \
+    if (result != MESSAGE_SUCCESS) { \
+      return result; \
+    } \
+    message_encode_words(destination, value, sizeof(type), width); \
+    return MESSAGE_SUCCESS; \
+  } \
+  static inline message_result_t message_tlv_fetch_##name(const message_t *message, type *value) \
+  { \
+    const tlv_t *tlv = message_tlv_find(message, TLV_##NAME); \
+    if (!tlv) { \
+      return MESSAGE_ERROR_TLV_NOT_FOUND; \
+    } \
+    if (tlv->length != sizeof(type)) { \
+      return MESSAGE_ERROR_INVALID_LENGTH; \
+    } \
+    message_decode_words(value, tlv->value, sizeof(type), width); \
+    return MESSAGE_SUCCESS; \
+  }
+MESSAGE_TLV_SCHEMA(MESSAGE_TLV_CODEC)
+#undef MESSAGE_TLV_CODEC
+
 message_result_t message_tlv_add_command(message_t *message, tlv_command_t command)
 {
   uint8_t _command = command;
-  return message_tlv_add(message, TLV_COMMAND, sizeof(uint8_t), (uint8_t*) &_command);
+  return message_tlv_put_command(message, &_command);
 }
 
 message_result_t message_tlv_add_reply(message_t *message, tlv_reply_t reply)
 {
   uint8_t _reply = reply;
-  return message_tlv_add(message, TLV_REPLY, sizeof(uint8_t), (uint8_t*) &_reply);
+  return message_tlv_put_reply(message, &_reply);
 }
 
 message_result_t message_tlv_add_motor_position(message_t *message, const tlv_motor_position_t *position)
 {
-  tlv_motor_position_t tmp;
-  tmp.x = htonl(position->x);
-  tmp.y = htonl(position->y);
-  tmp.z = htonl(position->z);
-  return message_tlv_add(message, TLV_MOTOR_POSITION, sizeof(tlv_motor_position_t), (uint8_t*) &tmp);
+  return message_tlv_put_motor_position(message, position);
 }
 
 message_result_t message_tlv_add_error_report(message_t *message, const tlv_error_report_t *report)
 {
-  tlv_error_report_t tmp;
-  tmp.code = htonl(report->code);
-  return message_tlv_add(message, TLV_ERROR_REPORT, sizeof(tlv_error_report_t), (uint8_t*) &tmp);
+  return message_tlv_put_error_report(message, report);
 }
 
 message_result_t message_tlv_add_current_reading(message_t *message, uint16_t current)
 {
-  current = htons(current);
-  return message_tlv_add(message, TLV_CURRENT_READING, sizeof(uint16_t), (uint8_t*) &current);
+  return message_tlv_put_current_reading(message, &current);
 }
 
 message_result_t message_tlv_add_power_reading(message_t *message, uint16_t power)
 {
-  power = htons(power);
-  return message_tlv_add(message, TLV_POWER_READING, sizeof(uint16_t), (uint8_t*) &power);
+  return message_tlv_put_power_reading(message, &power);
+}
+
+message_result_t message_tlv_add_sequence(message_t *message, uint16_t sequence)
+{
+  return message_tlv_put_sequence(message, &sequence);
+}
+
+message_result_t message_tlv_add_interval(message_t *message, uint16_t interval)
+{
+  return message_tlv_put_interval(message, &interval);
 }
 
 message_result_t message_tlv_add_encoder_value(message_t *message, const tlv_encoder_value_t *value)
 {
-  tlv_encoder_value_t tmp;
-  tmp.x = htonl(value->x);
-  tmp.y = htonl(value->y);
-  return message_tlv_add(message, TLV_ENCODER_VALUE, sizeof(tlv_encoder_value_t), (uint8_t*) &tmp);
+  return message_tlv_put_encoder_value(message, value);
 }
 
 message_result_t message_tlv_add_vibration_value(message_t *message, const tlv_vibration_value_t *value)
 {
-  tlv_vibration_value_t tmp;
-  for (size_t i = 0; i < 4; i++) {
-    tmp.avg_x[i] = htonl(value->avg_x[i]);
-    tmp.avg_y[i] = htonl(value->avg_y[i]);
-    tmp.avg_z[i] = htonl(value->avg_z[i]);
-
-    tmp.max_x[i] = htonl(value->max_x[i]);
-    tmp.max_y[i] = htonl(value->max_y[i]);
-    tmp.max_z[i] = htonl(value->max_z[i]);
-  }
-  return message_tlv_add(message, TLV_VIBRATION_VALUE, sizeof(tlv_vibration_value_t), (uint8_t*) &tmp);
+  return message_tlv_put_vibration_value(message, value);
 }
 
 message_result_t message_tlv_add_sfp_calibration(message_t *message, const tlv_sfp_calibration_t *calibration)
 {
-  tlv_sfp_calibration_t tmp;
-  tmp.offset_x = htonl(calibration->offset_x);
-  tmp.offset_y = htonl(calibration->offset_y);
-  return message_tlv_add(message, TLV_SFP_CALIBRATION, sizeof(tlv_sfp_calibration_t), (uint8_t*) &tmp);
+  return message_tlv_put_sfp_calibration(message, calibration);
 }
 
 message_result_t message_tlv_add_checksum(message_t *message)
@@ -197,23 +405,39 @@ message_result_t message_tlv_add_checksum(message_t *message)
   return message_tlv_add(message, TLV_CHECKSUM, sizeof(uint32_t), (uint8_t*) &checksum);
 }
 
+const tlv_t *message_tlv_find(const message_t *message, uint8_t type)
+{
+  if (!message->index[type]) {
+    return NULL;
+  }
+
+  return &message->tlv[message->index[type] - 1];
+}
+
+int message_tlv_duplicated(const message_t *message, uint8_t type)
+{
+  return (message->duplicates[type / 8] >> (type % 8)) & 1;
+}
+
 message_result_t message_tlv_get(const message_t *message, uint8_t type, uint8_t *destination, size_t length)
 {
-  for (size_t i = 0; i < message->length; i++) {
-    if (message->tlv[i].type == type) {
-      assert(message->tlv[i].length <= length);
-      memcpy(destination, message->tlv[i].value, message->tlv[i].length);
-      return MESSAGE_SUCCESS;
-    }
+  const tlv_t *tlv = message_tlv_find(message, type);
+  if (!tlv) {
+    return MESSAGE_ERROR_TLV_NOT_FOUND;
   }
 
-  return MESSAGE_ERROR_TLV_NOT_FOUND;
+  if (tlv->length > length) {
+    return MESSAGE_ERROR_INVALID_LENGTH;
+  }
+
+  memcpy(destination, tlv->value, tlv->length);
+  return MESSAGE_SUCCESS;
 }
 
 message_result_t message_tlv_get_command(const message_t *message, tlv_command_t *command)
 {
   uint8_t _command;
-  message_result_t result = message_tlv_get(message, TLV_COMMAND, &_command, sizeof(uint8_t));
+  message_result_t result = message_tlv_fetch_command(message, &_command);
   if (result != MESSAGE_SUCCESS) {
     return result;
   }
@@ -226,7 +450,7 @@ message_result_t message_tlv_get_command(const message_t *message, tlv_command_t
 message_result_t message_tlv_get_reply(const message_t *message, tlv_reply_t *reply)
 {
   uint8_t _reply;
-  message_result_t result = message_tlv_get(message, TLV_REPLY, &_reply, sizeof(uint8_t));
+  message_result_t result = message_tlv_fetch_reply(message, &_reply);
   if (result != MESSAGE_SUCCESS) {
     return result;
   }
@@ -238,85 +462,85 @@ message_result_t message_tlv_get_reply(const message_t *message, tlv_reply_t *re
 
 message_result_t message_tlv_get_motor_position(const message_t *message, tlv_motor_position_t *position)
 {
-  message_result_t result = message_tlv_get(message, TLV_MOTOR_POSITION, (uint8_t*) position, sizeof(tlv_motor_position_t));
-  if (result != MESSAGE_SUCCESS) {
-    return result;
-  }
-
-  position->x = ntohl(position->x);
-  position->y = ntohl(position->y);
-  position->z = ntohl(position->z);
-
-  return MESSAGE_SUCCESS;
+  return message_tlv_fetch_motor_position(message, position);
 }
 
 message_result_t message_tlv_get_error_report(const message_t *message, tlv_error_report_t *report)
 {
-  message_result_t result = message_tlv_get(message, TLV_ERROR_REPORT, (uint8_t*) report, sizeof(tlv_error_report_t));
-  if (result != MESSAGE_SUCCESS) {
-    return result;
-  }
-
-  report->code = ntohl(report->code);
-
-  return MESSAGE_SUCCESS;
+  return message_tlv_fetch_error_report(message, report);
 }
 
 message_result_t message_tlv_get_current_reading(const message_t *message, uint16_t *current)
 {
-  message_result_t result = message_tlv_get(message, TLV_CURRENT_READING, (uint8_t*) current, sizeof(uint16_t));
-  if (result != MESSAGE_SUCCESS) {
-    return result;
-  }
-
-  *current = ntohs(*current);
+  return message_tlv_fetch_current_reading(message, current);
+}
 
-  return MESSAGE_SUCCESS;
+message_result_t message_tlv_get_power_reading(const message_t *message, uint16_t *power)
+{
+  return message_tlv_fetch_power_reading(message, power);
 }
 
-message_result_t message_tlv_get_encoder_value(const message_t *message, tlv_encoder_value_t *value)
+message_result_t message_tlv_get_sequence(const message_t *message, uint16_t *sequence)
 {
-  message_result_t result = message_tlv_get(message, TLV_ENCODER_VALUE, (uint8_t*) value, sizeof(tlv_encoder_value_t));
-  if (result != MESSAGE_SUCCESS) {
-    return result;
-  }
+  return message_tlv_fetch_sequence(message, sequence);
+}
 
-  value->x = ntohl(value->x);
-  value->y = ntohl(value->y);
+message_result_t message_tlv_get_interval(const message_t *message, uint16_t *interval)
+{
+  return message_tlv_fetch_interval(message, interval);
+}
 
-  return MESSAGE_SUCCESS;
+message_result_t message_tlv_get_encoder_value(const message_t *message, tlv_encoder_value_t *value)
+{
+  return message_tlv_fetch_encoder_value(message, value);
 }
 
 message_result_t message_tlv_get_vibration_value(const message_t *message, tlv_vibration_value_t *value)
 {
-  message_result_t result = message_tlv_get(message, TLV_VIBRATION_VALUE, (uint8_t*) value,
-                                            sizeof(tlv_vibration_value_t));
-  if (result != MESSAGE_SUCCESS) {
-    return result;
-  }
+  return message_tlv_fetch_vibration_value(message, value);
+}
 
-  for (size_t i = 0; i < 4; i++) {
-    value->avg_x[i] = ntohl(value->avg_x[i]);
-    value->avg_y[i] = ntohl(value->avg_y[i]);
-    value->avg_z[i] = ntohl(value->avg_z[i]);
+message_result_t message_tlv_get_sfp_calibration(const message_t *message, tlv_sfp_calibration_t *calibration)
+{
+  return message_tlv_fetch_sfp_calibration(message, calibration);
+}
 
-    value->max_x[i] = ntohl(value->max_x[i]);
-    value->max_y[i] = ntohl(value->max_y[i]);
-    value->max_z[i] = ntohl(value->max_z[i]);
+message_result_t message_validate(const message_t *message)
+{
+  for (size_t i = 0; i < message->length; i++) {
+    uint16_t size = message_tlv_size[message->tlv[i].type];
+    if (size && message->tlv[i].length != size) {
+      return MESSAGE_ERROR_INVALID_LENGTH;
+    }
   }
 
   return MESSAGE_SUCCESS;
 }
 
-message_result_t message_tlv_get_sfp_calibration(const message_t *message, tlv_sfp_calibration_t *calibration)
+message_result_t message_decode(const message_t *message, message_report_t *report)
 {
-  message_result_t result = message_tlv_get(message, TLV_SFP_CALIBRATION, (uint8_t*) calibration, sizeof(tlv_sfp_calibration_t));
-  if (result != MESSAGE_SUCCESS) {
-    return result;
-  }
+  report->present = 0;
 
-  calibration->offset_x = ntohl(calibration->offset_x);
-  calibration->offset_y = ntohl(calibration->offset_y);
+  for (size_t i = 0; i < message->length; i++) {
+    const tlv_t *tlv = &message->tlv[i];
+
+    switch (tlv->type) {
+#define MESSAGE_TLV_DECODE(name, NAME, type, width) \
+      case TLV_##NAME: { \
+        if (tlv->length != sizeof(type)) { \
+          return MESSAGE_ERROR_INVALID_LENGTH; \
+        } \
+        if (!MESSAGE_REPORT_HAS(report, NAME)) { \
+          message_decode_words(&report->name, tlv->value, sizeof(type), width); \
+          report->present |= 1 << MESSAGE_FIELD_##NAME; \
+        } \
+        break; \
+      }
+      MESSAGE_TLV_SCHEMA(MESSAGE_TLV_DECODE)
+#undef MESSAGE_TLV_DECODE
+      default: break;
+    }
+  }
 
   return MESSAGE_SUCCESS;
 }
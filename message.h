@@ -24,6 +24,8 @@
 
 // Maximum number of TLVs inside a message.
 #define MAX_TLV_COUNT 25
+// Suggested arena size for short command messages.
+#define MESSAGE_ARENA_SIZE 128
 
 /**
  * TLVs supported by the protocol.
@@ -39,6 +41,8 @@ typedef enum {
   TLV_POWER_READING = 8,
   TLV_ENCODER_VALUE = 9,
   TLV_VIBRATION_VALUE = 10,
+  TLV_SEQUENCE = 11,
+  TLV_INTERVAL = 12,
 
   // Network communication TLVs.
   TLV_NET_HELLO = 100,
@@ -56,6 +60,7 @@ typedef enum {
   COMMAND_FIRMWARE_UPGRADE = 5,
   COMMAND_HOMING = 6,
   COMMAND_RESTORE_MOTOR = 7,
+  COMMAND_SUBSCRIBE = 8,
 } tlv_command_t;
 
 /**
@@ -113,6 +118,51 @@ typedef struct {
   uint32_t offset_y;
 } tlv_sfp_calibration_t;
 
+/**
+ * Schema of the fixed-size TLVs. Each entry defines the TLV name, the suffix
+ * of its tlv_type_t constant, its host representation and the width of the
+ * big-endian words that the value consists of on the wire. Encoders, decoders
+ * and length validation are generated from this table, so adding a TLV only
+ * requires a new entry here and the corresponding tlv_type_t constant.
+ */
+#define MESSAGE_TLV_SCHEMA(_) \
+  _(command,         COMMAND,         uint8_t,               sizeof(uint8_t)) \
+  _(reply,           REPLY,           uint8_t,               sizeof(uint8_t)) \
+  _(motor_position,  MOTOR_POSITION,  tlv_motor_position_t,  sizeof(int32_t)) \
+  _(current_reading, CURRENT_READING, uint16_t,              sizeof(uint16_t)) \
+  _(sfp_calibration, SFP_CALIBRATION, tlv_sfp_calibration_t, sizeof(uint32_t)) \
+  _(error_report,    ERROR_REPORT,    tlv_error_report_t,    sizeof(uint32_t)) \
+  _(power_reading,   POWER_READING,   uint16_t,              sizeof(uint16_t)) \
+  _(encoder_value,   ENCODER_VALUE,   tlv_encoder_value_t,   sizeof(int32_t)) \
+  _(vibration_value, VIBRATION_VALUE, tlv_vibration_value_t, sizeof(int32_t)) \
+  _(sequence,        SEQUENCE,        uint16_t,              sizeof(uint16_t)) \
+  _(interval,        INTERVAL,        uint16_t,              sizeof(uint16_t))
+
+/**
+ * Fields of a decoded message report, one for each schema entry.
+ */
+typedef enum {
+#define MESSAGE_TLV_FIELD(name, NAME, type, width) MESSAGE_FIELD_##NAME,
+  MESSAGE_TLV_SCHEMA(MESSAGE_TLV_FIELD)
+#undef MESSAGE_TLV_FIELD
+  __MESSAGE_FIELD_MAX,
+} message_field_t;
+
+/**
+ * All schema TLVs of a message, decoded into their host representation.
+ */
+typedef struct {
+  // Bitmask of decoded fields (bit positions are message_field_t values).
+  uint32_t present;
+
+#define MESSAGE_TLV_FIELD(name, NAME, type, width) type name;
+  MESSAGE_TLV_SCHEMA(MESSAGE_TLV_FIELD)
+#undef MESSAGE_TLV_FIELD
+} message_report_t;
+
+// Checks whether a field is present in a decoded message report.
+#define MESSAGE_REPORT_HAS(report, NAME) (((report)->present >> MESSAGE_FIELD_##NAME) & 1)
+
 /**
  * Message operations result codes.
  */
@@ -123,9 +173,23 @@ typedef enum {
   MESSAGE_ERROR_BUFFER_TOO_SMALL = -3,
   MESSAGE_ERROR_PARSE_ERROR = -4,
   MESSAGE_ERROR_CHECKSUM_MISMATCH = -5,
-  MESSAGE_ERROR_TLV_NOT_FOUND = -6
+  MESSAGE_ERROR_TLV_NOT_FOUND = -6,
+  MESSAGE_ERROR_READ_ONLY = -7,
+  MESSAGE_ERROR_INVALID_LENGTH = -8
 } message_result_t;
 
+/**
+ * Ownership of the TLV values contained in a message.
+ */
+typedef enum {
+  // Values are allocated on the heap and owned by the message.
+  MESSAGE_STORAGE_HEAP = 0,
+  // Values point into an external buffer and are only valid while it is.
+  MESSAGE_STORAGE_BORROWED,
+  // Values are stored in a caller-supplied arena.
+  MESSAGE_STORAGE_ARENA,
+} message_storage_t;
+
 /**
  * Representation of a TLV.
  */
@@ -140,7 +204,18 @@ typedef struct {
  */
 typedef struct {
   size_t length;
+  message_storage_t storage;
   tlv_t tlv[MAX_TLV_COUNT];
+
+  // Position of the first TLV of each type plus one (zero when not present).
+  uint8_t index[256];
+  // Bitmap of TLV types that occur more than once.
+  uint8_t duplicates[256 / 8];
+
+  // Arena used for TLV values when storage is MESSAGE_STORAGE_ARENA.
+  uint8_t *arena;
+  size_t arena_size;
+  size_t arena_used;
 } message_t;
 
 /**
@@ -153,7 +228,21 @@ typedef struct {
 message_result_t message_init(message_t *message);
 
 /**
- * Frees a protocol message.
+ * Initializes a protocol message which stores all TLV values in the given
+ * arena instead of allocating them on the heap. Adding a TLV that does not
+ * fit into the remaining arena space fails with MESSAGE_ERROR_BUFFER_TOO_SMALL.
+ * The arena must outlive the message.
+ *
+ * @param message Message instance to initialize
+ * @param arena Arena buffer
+ * @param size Size of the arena buffer
+ * @return Operation result code
+ */
+message_result_t message_init_arena(message_t *message, uint8_t *arena, size_t size);
+
+/**
+ * Frees a protocol message. Messages using an arena are reset to an empty
+ * message that may be reused with the same arena.
  *
  * @param message Message instance to free
  */
@@ -169,6 +258,39 @@ void message_free(message_t *message);
  */
 message_result_t message_parse(message_t *message, const uint8_t *data, size_t length);
 
+/**
+ * Parses a protocol message without copying TLV values. The values of the
+ * resulting message point directly into the data buffer, so the message is
+ * only valid for as long as the buffer is and must not be modified. Use
+ * message_copy if the message needs to be kept.
+ *
+ * @param message Destination message instance to parse into
+ * @param data Raw data to parse
+ * @param length Size of the data buffer
+ * @return Operation result code
+ */
+message_result_t message_parse_view(message_t *message, const uint8_t *data, size_t length);
+
+/**
+ * Checks that raw data is a well-formed protocol message and that any checksum
+ * TLVs it contains are valid, without materializing the TLVs.
+ *
+ * @param data Raw data to verify
+ * @param length Size of the data buffer
+ * @return Operation result code
+ */
+message_result_t message_verify(const uint8_t *data, size_t length);
+
+/**
+ * Copies a protocol message, including all of its TLV values. The copy owns
+ * its values and must be freed using message_free.
+ *
+ * @param destination Destination message instance
+ * @param source Source message instance
+ * @return Operation result code
+ */
+message_result_t message_copy(message_t *destination, const message_t *source);
+
 /**
  * Adds a raw TLV to a protocol message.
  *
@@ -234,6 +356,26 @@ message_result_t message_tlv_add_current_reading(message_t *message, uint16_t cu
  */
 message_result_t message_tlv_add_power_reading(message_t *message, uint16_t power);
 
+/**
+ * Adds a sequence number TLV to a protocol message. Devices that support it
+ * echo the sequence number of a command in their reply.
+ *
+ * @param message Destination message instance to add the TLV to
+ * @param sequence Sequence number
+ * @return Operation result code
+ */
+message_result_t message_tlv_add_sequence(message_t *message, uint16_t sequence);
+
+/**
+ * Adds an interval TLV to a protocol message. It is used by the subscribe
+ * command to request status reports at the given interval.
+ *
+ * @param message Destination message instance to add the TLV to
+ * @param interval Interval (in milliseconds)
+ * @return Operation result code
+ */
+message_result_t message_tlv_add_interval(message_t *message, uint16_t interval);
+
 /**
  * Adds an encoder value TLV to a protocol message.
  *
@@ -271,7 +413,27 @@ message_result_t message_tlv_add_sfp_calibration(message_t *message, const tlv_s
 message_result_t message_tlv_add_checksum(message_t *message);
 
 /**
- * Find the first TLV of a given type in a message and copies it.
+ * Find the first TLV of a given type in a message.
+ *
+ * @param message Message instance to get the TLV from
+ * @param type Type of TLV that should be returned
+ * @return TLV instance or NULL if not present
+ */
+const tlv_t *message_tlv_find(const message_t *message, uint8_t type);
+
+/**
+ * Checks whether a message contains more than one TLV of a given type. Only
+ * the first such TLV is returned by message_tlv_find and the getters.
+ *
+ * @param message Message instance to check
+ * @param type TLV type
+ * @return 1 if the type is duplicated, 0 otherwise
+ */
+int message_tlv_duplicated(const message_t *message, uint8_t type);
+
+/**
+ * Find the first TLV of a given type in a message and copies it. Fails with
+ * MESSAGE_ERROR_INVALID_LENGTH if the destination buffer is too small.
  *
  * @param message Message instance to get the TLV from
  * @param type Type of TLV that should be returned
@@ -335,6 +497,33 @@ message_result_t message_tlv_get_current_reading(const message_t *message, uint1
  */
 message_result_t message_tlv_get_encoder_value(const message_t *message, tlv_encoder_value_t *value);
 
+/**
+ * Find the first power reading TLV in a message and copies it.
+ *
+ * @param message Message instance to get the TLV from
+ * @param power Destination power variable
+ * @return Operation result code
+ */
+message_result_t message_tlv_get_power_reading(const message_t *message, uint16_t *power);
+
+/**
+ * Find the first sequence number TLV in a message and copies it.
+ *
+ * @param message Message instance to get the TLV from
+ * @param sequence Destination sequence number variable
+ * @return Operation result code
+ */
+message_result_t message_tlv_get_sequence(const message_t *message, uint16_t *sequence);
+
+/**
+ * Find the first interval TLV in a message and copies it.
+ *
+ * @param message Message instance to get the TLV from
+ * @param interval Destination interval variable
+ * @return Operation result code
+ */
+message_result_t message_tlv_get_interval(const message_t *message, uint16_t *interval);
+
 /**
  * Find the first vibration value TLV in a message and copies it.
  *
@@ -353,6 +542,25 @@ message_result_t message_tlv_get_vibration_value(const message_t *message, tlv_v
  */
 message_result_t message_tlv_get_sfp_calibration(const message_t *message, tlv_sfp_calibration_t *calibration);
 
+/**
+ * Checks that all TLVs defined in the schema have the expected length.
+ *
+ * @param message Message instance to validate
+ * @return Operation result code
+ */
+message_result_t message_validate(const message_t *message);
+
+/**
+ * Decodes all schema TLVs of a message into a report in a single pass. When a
+ * TLV type occurs multiple times, the first one is used. Fails if any schema
+ * TLV has an unexpected length.
+ *
+ * @param message Message instance to decode
+ * @param report Destination report
+ * @return Operation result code
+ */
+message_result_t message_decode(const message_t *message, message_report_t *report);
+
 /**
  * Returns the size a message would take in its serialized form.
  *
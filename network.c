@@ -217,7 +217,8 @@ void network_announce_ourselves(struct uloop_timeout *timer)
 {
   // TODO: Generate announce message.
   message_t msg;
-  message_init(&msg);
+  uint8_t arena[MESSAGE_ARENA_SIZE];
+  message_init_arena(&msg, arena, sizeof(arena));
   network_send_message(&msg);
   message_free(&msg);
 
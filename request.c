@@ -0,0 +1,298 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "request.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+
+int request_histogram_index(tlv_command_t command);
+void request_histogram_add(request_histogram_t *histogram, uint64_t rtt);
+request_t *request_tracker_allocate(request_tracker_t *tracker, tlv_command_t command, uint8_t retries,
+                                    uint64_t timestamp);
+int request_tracker_expects_reply(const request_tracker_t *tracker, tlv_command_t command);
+void request_tracker_dispatch(request_tracker_t *tracker, uint64_t timestamp);
+
+void request_tracker_init(request_tracker_t *tracker, request_send_handler send, void *context,
+                          size_t window, uint64_t timeout)
+{
+  memset(tracker, 0, sizeof(request_tracker_t));
+  tracker->send = send;
+  tracker->context = context;
+  tracker->window = window;
+  tracker->timeout = timeout;
+
+  if (tracker->window < 1) {
+    tracker->window = 1;
+  } else if (tracker->window > REQUEST_MAX_IN_FLIGHT) {
+    tracker->window = REQUEST_MAX_IN_FLIGHT;
+  }
+}
+
+int request_histogram_index(tlv_command_t command)
+{
+  switch (command) {
+    case COMMAND_GET_STATUS: return REQUEST_HISTOGRAM_GET_STATUS;
+    case COMMAND_MOVE_MOTOR: return REQUEST_HISTOGRAM_MOVE_MOTOR;
+    case COMMAND_HOMING: return REQUEST_HISTOGRAM_HOMING;
+    default: return -1;
+  }
+}
+
+size_t request_histogram_bucket(uint64_t rtt)
+{
+  size_t bucket = rtt ? 64 - __builtin_clzll(rtt) : 0;
+  if (bucket >= REQUEST_HISTOGRAM_BUCKETS) {
+    bucket = REQUEST_HISTOGRAM_BUCKETS - 1;
+  }
+
+  return bucket;
+}
+
+void request_histogram_add(request_histogram_t *histogram, uint64_t rtt)
+{
+  histogram->buckets[request_histogram_bucket(rtt)]++;
+  if (!histogram->count || rtt < histogram->min) {
+    histogram->min = rtt;
+  }
+  if (rtt > histogram->max) {
+    histogram->max = rtt;
+  }
+  histogram->count++;
+  histogram->sum += rtt;
+}
+
+int request_tracker_expects_reply(const request_tracker_t *tracker, tlv_command_t command)
+{
+  // Devices without sequence number support only reply to status requests.
+  return command == COMMAND_GET_STATUS || tracker->sequence_supported;
+}
+
+request_t *request_tracker_allocate(request_tracker_t *tracker, tlv_command_t command, uint8_t retries,
+                                    uint64_t timestamp)
+{
+  for (size_t i = 0; i < REQUEST_MAX_IN_FLIGHT; i++) {
+    request_t *request = &tracker->requests[i];
+    if (request->state != REQUEST_FREE) {
+      continue;
+    }
+
+    request->sequence = tracker->next_sequence++;
+    request->command = command;
+    request->retries = retries;
+    request->timestamp = timestamp;
+    request->order = tracker->next_order++;
+    request->frame_length = 0;
+    return request;
+  }
+
+  tracker->rejected++;
+  return NULL;
+}
+
+int request_tracker_submit(request_tracker_t *tracker, message_t *message, tlv_command_t command,
+                           uint8_t retries, uint64_t timestamp)
+{
+  request_t *request = request_tracker_allocate(tracker, command, retries, timestamp);
+  if (!request) {
+    return -1;
+  }
+
+  if (message_tlv_add_sequence(message, request->sequence) != MESSAGE_SUCCESS) {
+    return -1;
+  }
+
+  ssize_t length = frame_message_checksum(request->frame, sizeof(request->frame), message);
+  if (length < 0) {
+    return -1;
+  }
+
+  request->frame_length = length;
+  request->state = REQUEST_PENDING;
+  request_tracker_dispatch(tracker, timestamp);
+  return 0;
+}
+
+int request_tracker_submit_template(request_tracker_t *tracker, frame_template_t *template,
+                                    tlv_command_t command, uint8_t retries, uint64_t timestamp)
+{
+  request_t *request = request_tracker_allocate(tracker, command, retries, timestamp);
+  if (!request) {
+    return -1;
+  }
+
+  uint16_t sequence = htons(request->sequence);
+  if (frame_template_patch_tlv(template, TLV_SEQUENCE, (uint8_t*) &sequence, sizeof(sequence)) != 0 ||
+      template->frame_length > sizeof(request->frame)) {
+    return -1;
+  }
+
+  memcpy(request->frame, template->frame, template->frame_length);
+  request->frame_length = template->frame_length;
+  request->state = REQUEST_PENDING;
+  request_tracker_dispatch(tracker, timestamp);
+  return 0;
+}
+
+void request_tracker_dispatch(request_tracker_t *tracker, uint64_t timestamp)
+{
+  while (request_tracker_count(tracker, REQUEST_IN_FLIGHT) < tracker->window) {
+    // Send the oldest pending request.
+    request_t *request = NULL;
+    for (size_t i = 0; i < REQUEST_MAX_IN_FLIGHT; i++) {
+      request_t *candidate = &tracker->requests[i];
+      if (candidate->state == REQUEST_PENDING && (!request || candidate->order < request->order)) {
+        request = candidate;
+      }
+    }
+
+    if (!request) {
+      break;
+    }
+
+    if (tracker->send(tracker->context, request->frame, request->frame_length) != 0) {
+      // Keep it queued and try again on the next poll.
+      break;
+    }
+
+    if (request_tracker_expects_reply(tracker, request->command)) {
+      request->state = REQUEST_IN_FLIGHT;
+      request->timestamp = timestamp;
+    } else {
+      request->state = REQUEST_FREE;
+    }
+  }
+}
+
+int request_tracker_complete(request_tracker_t *tracker, const message_report_t *reply,
+                             uint64_t timestamp, request_t *request)
+{
+  request_t *match = NULL;
+  if (MESSAGE_REPORT_HAS(reply, SEQUENCE)) {
+    tracker->sequence_supported = 1;
+
+    for (size_t i = 0; i < REQUEST_MAX_IN_FLIGHT; i++) {
+      request_t *candidate = &tracker->requests[i];
+      if (candidate->state == REQUEST_IN_FLIGHT && candidate->sequence == reply->sequence) {
+        match = candidate;
+        break;
+      }
+    }
+  } else if (MESSAGE_REPORT_HAS(reply, REPLY) && reply->reply == REPLY_STATUS_REPORT) {
+    for (size_t i = 0; i < REQUEST_MAX_IN_FLIGHT; i++) {
+      request_t *candidate = &tracker->requests[i];
+      if (candidate->state != REQUEST_IN_FLIGHT || candidate->command != COMMAND_GET_STATUS) {
+        continue;
+      }
+
+      if (!match || candidate->timestamp < match->timestamp) {
+        match = candidate;
+      }
+    }
+  }
+
+  if (!match) {
+    tracker->unmatched++;
+    return -1;
+  }
+
+  int index = request_histogram_index(match->command);
+  if (index >= 0 && timestamp >= match->timestamp) {
+    request_histogram_add(&tracker->histograms[index], (timestamp - match->timestamp) / 1000);
+  }
+
+  match->state = REQUEST_FREE;
+  if (request) {
+    *request = *match;
+  }
+
+  request_tracker_dispatch(tracker, timestamp);
+  return 0;
+}
+
+size_t request_tracker_poll(request_tracker_t *tracker, uint64_t timestamp)
+{
+  size_t expired = 0;
+  for (size_t i = 0; i < REQUEST_MAX_IN_FLIGHT; i++) {
+    request_t *request = &tracker->requests[i];
+    if (request->state == REQUEST_FREE || timestamp < request->timestamp + tracker->timeout) {
+      continue;
+    }
+
+    if (request->state == REQUEST_IN_FLIGHT && request->retries > 0) {
+      // Queue it again, it keeps its place in the submission order.
+      request->retries--;
+      request->state = REQUEST_PENDING;
+      request->timestamp = timestamp;
+      tracker->retried++;
+    } else {
+      request->state = REQUEST_FREE;
+      expired++;
+    }
+  }
+
+  tracker->expired += expired;
+  request_tracker_dispatch(tracker, timestamp);
+  return expired;
+}
+
+uint64_t request_tracker_next_deadline(const request_tracker_t *tracker)
+{
+  uint64_t deadline = 0;
+  for (size_t i = 0; i < REQUEST_MAX_IN_FLIGHT; i++) {
+    const request_t *request = &tracker->requests[i];
+    if (request->state == REQUEST_FREE) {
+      continue;
+    }
+
+    if (!deadline || request->timestamp + tracker->timeout < deadline) {
+      deadline = request->timestamp + tracker->timeout;
+    }
+  }
+
+  return deadline;
+}
+
+void request_tracker_flush(request_tracker_t *tracker)
+{
+  for (size_t i = 0; i < REQUEST_MAX_IN_FLIGHT; i++) {
+    tracker->requests[i].state = REQUEST_FREE;
+  }
+}
+
+size_t request_tracker_count(const request_tracker_t *tracker, request_state_t state)
+{
+  size_t count = 0;
+  for (size_t i = 0; i < REQUEST_MAX_IN_FLIGHT; i++) {
+    if (tracker->requests[i].state == state) {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+const request_histogram_t *request_tracker_histogram(const request_tracker_t *tracker, tlv_command_t command)
+{
+  int index = request_histogram_index(command);
+  if (index < 0) {
+    return NULL;
+  }
+
+  return &tracker->histograms[index];
+}
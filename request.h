@@ -0,0 +1,237 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_DRIVER_REQUEST_H
+#define KORUZA_DRIVER_REQUEST_H
+
+#include "message.h"
+#include "frame.h"
+
+// Number of request slots, which bounds both queued and in-flight requests.
+#define REQUEST_MAX_IN_FLIGHT 16
+// Maximum size of an encoded request frame.
+#define REQUEST_FRAME_MAX_SIZE 96
+// Number of round-trip time histogram buckets. Bucket 0 counts round trips
+// below one microsecond, bucket i > 0 counts [2^(i - 1), 2^i) microseconds
+// and the last bucket also counts everything above.
+#define REQUEST_HISTOGRAM_BUCKETS 24
+
+/**
+ * Commands with round-trip time histograms.
+ */
+typedef enum {
+  REQUEST_HISTOGRAM_GET_STATUS = 0,
+  REQUEST_HISTOGRAM_MOVE_MOTOR,
+  REQUEST_HISTOGRAM_HOMING,
+  __REQUEST_HISTOGRAM_MAX,
+} request_histogram_index_t;
+
+/**
+ * Round-trip time histogram (all times in microseconds).
+ */
+typedef struct {
+  uint64_t buckets[REQUEST_HISTOGRAM_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+} request_histogram_t;
+
+/**
+ * Request slot states.
+ */
+typedef enum {
+  REQUEST_FREE = 0,
+  // Waiting for space in the command window.
+  REQUEST_PENDING,
+  // Sent and waiting for a reply.
+  REQUEST_IN_FLIGHT,
+} request_state_t;
+
+/**
+ * Request to a device, which holds its own encoded frame so it can be sent
+ * once there is space in the window and resent on timeout.
+ */
+typedef struct {
+  request_state_t state;
+  uint16_t sequence;
+  tlv_command_t command;
+  // Monotonic time when the request was last sent or, while it is pending,
+  // queued (in nanoseconds).
+  uint64_t timestamp;
+  // Submission order, used to send pending requests first come first served.
+  uint64_t order;
+  // Number of times the request may still be resent on timeout.
+  uint8_t retries;
+
+  uint8_t frame[REQUEST_FRAME_MAX_SIZE];
+  size_t frame_length;
+} request_t;
+
+/**
+ * Handler used to transmit request frames.
+ *
+ * @param context Opaque context given to the tracker
+ * @param frame Encoded frame
+ * @param length Length of the frame
+ * @return Zero when the frame was sent
+ */
+typedef int (*request_send_handler)(void *context, const uint8_t *frame, size_t length);
+
+/**
+ * Tracker of requests sent to a single device. Up to window requests are in
+ * flight at the same time, while the others wait in a queue.
+ */
+typedef struct {
+  request_send_handler send;
+  void *context;
+  // Maximum number of requests in flight.
+  size_t window;
+  // Time after which an in-flight request is resent or expired and after which
+  // a request that could not be sent is dropped (in nanoseconds).
+  uint64_t timeout;
+
+  uint16_t next_sequence;
+  uint64_t next_order;
+  request_t requests[REQUEST_MAX_IN_FLIGHT];
+  request_histogram_t histograms[__REQUEST_HISTOGRAM_MAX];
+
+  // Set once the device has echoed a sequence number.
+  uint8_t sequence_supported;
+  // Number of replies that could not be matched to a request.
+  uint64_t unmatched;
+  // Number of requests that never got a reply.
+  uint64_t expired;
+  // Number of resent requests.
+  uint64_t retried;
+  // Number of requests rejected because all slots were taken.
+  uint64_t rejected;
+} request_tracker_t;
+
+/**
+ * Initializes the request tracker.
+ *
+ * @param tracker Tracker instance
+ * @param send Handler used to transmit frames
+ * @param context Opaque context passed to the send handler
+ * @param window Maximum number of requests in flight
+ * @param timeout Reply timeout (in nanoseconds)
+ */
+void request_tracker_init(request_tracker_t *tracker, request_send_handler send, void *context,
+                          size_t window, uint64_t timeout);
+
+/**
+ * Queues a command message for transmission. A sequence number and checksum
+ * are appended to the message, so it should contain neither. The request is
+ * sent right away when there is space in the window.
+ *
+ * @param tracker Tracker instance
+ * @param message Command message
+ * @param command Command being sent
+ * @param retries Number of times the command is resent on timeout
+ * @param timestamp Current monotonic time (in nanoseconds)
+ * @return Zero on success, -1 if all slots are taken or the message is too large
+ */
+int request_tracker_submit(request_tracker_t *tracker, message_t *message, tlv_command_t command,
+                           uint8_t retries, uint64_t timestamp);
+
+/**
+ * Queues a command from a frame template for transmission. The template must
+ * contain a sequence number TLV following its variable TLV, which is patched
+ * before the frame is copied into the request.
+ *
+ * @param tracker Tracker instance
+ * @param template Frame template
+ * @param command Command being sent
+ * @param retries Number of times the command is resent on timeout
+ * @param timestamp Current monotonic time (in nanoseconds)
+ * @return Zero on success, -1 if all slots are taken or the template is invalid
+ */
+int request_tracker_submit_template(request_tracker_t *tracker, frame_template_t *template,
+                                    tlv_command_t command, uint8_t retries, uint64_t timestamp);
+
+/**
+ * Matches a reply to an in-flight request and records the round-trip time.
+ * Replies with a sequence number are matched exactly. Replies without one
+ * come from devices that do not echo sequence numbers, and are matched to
+ * the oldest in-flight status request, as that is the only command those
+ * devices reply to. Pending requests are sent when the window opens up.
+ *
+ * @param tracker Tracker instance
+ * @param reply Decoded reply message
+ * @param timestamp Monotonic time of reception (in nanoseconds)
+ * @param request Optional destination for the matched request
+ * @return Zero when the reply was matched, -1 otherwise
+ */
+int request_tracker_complete(request_tracker_t *tracker, const message_report_t *reply,
+                             uint64_t timestamp, request_t *request);
+
+/**
+ * Resends or expires timed out requests and sends pending requests while
+ * there is space in the window. Pending requests that could not be sent
+ * within the timeout expire as well, so requests do not pile up while a
+ * device is unavailable.
+ *
+ * @param tracker Tracker instance
+ * @param timestamp Current monotonic time (in nanoseconds)
+ * @return Number of requests that expired
+ */
+size_t request_tracker_poll(request_tracker_t *tracker, uint64_t timestamp);
+
+/**
+ * Returns the time at which request_tracker_poll should next be called.
+ *
+ * @param tracker Tracker instance
+ * @return Monotonic time (in nanoseconds) or zero if nothing is queued or in flight
+ */
+uint64_t request_tracker_next_deadline(const request_tracker_t *tracker);
+
+/**
+ * Drops all queued and in-flight requests.
+ *
+ * @param tracker Tracker instance
+ */
+void request_tracker_flush(request_tracker_t *tracker);
+
+/**
+ * Returns the number of requests in the given state.
+ *
+ * @param tracker Tracker instance
+ * @param state Request state
+ * @return Number of requests
+ */
+size_t request_tracker_count(const request_tracker_t *tracker, request_state_t state);
+
+/**
+ * Returns the round-trip time histogram for a command.
+ *
+ * @param tracker Tracker instance
+ * @param command Command
+ * @return Histogram or NULL if the command has no histogram
+ */
+const request_histogram_t *request_tracker_histogram(const request_tracker_t *tracker, tlv_command_t command);
+
+/**
+ * Returns the histogram bucket for a round-trip time.
+ *
+ * @param rtt Round-trip time (in microseconds)
+ * @return Bucket index
+ */
+size_t request_histogram_bucket(uint64_t rtt);
+
+#endif
@@ -17,88 +17,274 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "serial.h"
+#include "serial_port.h"
+#include "capture.h"
 #include "configuration.h"
 
 #include <libubox/uloop.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
+#include <libgen.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <syslog.h>
 #include <arpa/inet.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <termios.h>
 #include <string.h>
 #include <errno.h>
 
+// Size of the stack buffer used for framing outgoing messages.
+#define SERIAL_FRAME_BUFFER_SIZE 512
+// Size of the per-device transmit queue.
+#define SERIAL_TX_QUEUE_SIZE 2048
+// Default maximum length of received frames. Status and vibration reports
+// are well below this size.
+#define SERIAL_MAX_FRAME_LENGTH 1024
+// Default line speed.
+#define SERIAL_BAUDRATE 115200
+// Size of the receive buffer. Reads are repeated until the device is drained.
+#define SERIAL_READ_BUFFER_SIZE 1024
+// Initial and maximum interval between attempts to open a device that exists
+// but could not be opened (in milliseconds).
+#define SERIAL_RETRY_INTERVAL_MIN 500
+#define SERIAL_RETRY_INTERVAL_MAX 30000
+// Events on device directories that may make a device available.
+#define SERIAL_HOTPLUG_EVENTS (IN_CREATE | IN_ATTRIB | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)
+
 struct serial_device {
+  // Identifier and name of the device.
+  serial_device_t id;
+  char *name;
+  // Role of the device.
+  serial_role_t role;
+  // Set when the daemon cannot operate without this device.
+  uint8_t required;
   uint8_t ready;
   // Device.
   char *device;
+  // Watch descriptor of the device directory or -1 when it is not watched.
+  int watch;
+  // Reopen attempts with exponential backoff.
+  struct uloop_timeout retry;
+  int retry_interval;
+  // Time when the device appeared and the frame count at that time, used to
+  // measure the latency until the first frame. Zero once measured.
+  uint64_t attach_time;
+  uint64_t attach_frames;
   // Serial device uloop file descriptor wrapper.
   struct uloop_fd ufd;
   // Frame parser.
   parser_t parser;
+  // Handler called when the device is closed.
+  serial_disconnect_handler disconnect_handler;
+  void *disconnect_context;
+  // Maximum length of received frames.
+  size_t max_frame_length;
+  // Line speed (in bits per second).
+  uint32_t baudrate;
+  // Set to configure the device for low receive latency.
+  uint8_t low_latency;
+  // Device statistics (receive side is kept by the parser).
+  struct serial_statistics statistics;
+
+  // Transmit queue, drained when the device becomes writable.
+  uint8_t tx_queue[SERIAL_TX_QUEUE_SIZE];
+  size_t tx_head;
+  size_t tx_length;
 };
 
-static struct serial_device device_motors;
-static struct serial_device device_accelerometer;
+static struct serial_device devices[SERIAL_MAX_DEVICES];
+static int device_count;
+// Watcher of device directories.
+static struct uloop_fd hotplug_ufd;
+// Capture of serial traffic (disabled when the file descriptor is negative).
+static capture_t capture = { .fd = -1 };
+
+/**
+ * Role names used in configuration.
+ */
+static const char *serial_role_names[] = {
+  [SERIAL_ROLE_NONE] = "none",
+  [SERIAL_ROLE_MOTORS] = "motors",
+  [SERIAL_ROLE_ACCELEROMETER] = "accelerometer",
+  [SERIAL_ROLE_SENSOR] = "sensor",
+};
 
+int serial_register_device(struct uci_context *uci, const char *section, const char *device, serial_role_t role);
+serial_role_t serial_parse_role(const char *role);
 int serial_start_device(struct serial_device *cfg);
 int serial_init_device(struct serial_device *cfg, int quiet);
-int serial_reinit_device(struct serial_device *cfg);
+void serial_close_device(struct serial_device *cfg);
+void serial_schedule_open(struct serial_device *cfg);
+void serial_retry_handler(struct uloop_timeout *timeout);
+int serial_hotplug_init(void);
+void serial_hotplug_handler(struct uloop_fd *ufd, unsigned int events);
+int serial_flush_device(struct serial_device *cfg);
 struct serial_device *serial_get_device(serial_device_t device);
-struct serial_device *serial_get_device_fd(int fd);
 void serial_fd_handler(struct uloop_fd *ufd, unsigned int events);
 
 int serial_init(struct uci_context *uci)
 {
-  int result = 0;
+  device_count = 0;
 
-  // Motors MCU.
-  device_motors.ready = 0;
-  device_motors.device = uci_get_string(uci, "koruza.@mcu[0].device");
-  if (!device_motors.device) {
-    device_motors.device = "/dev/ttyS1";
+  for (int i = 0; i < SERIAL_MAX_DEVICES; i++) {
+    char section[32];
+    snprintf(section, sizeof(section), "koruza.@serial[%d]", i);
+    if (serial_register_device(uci, section, NULL, SERIAL_ROLE_NONE) != 0) {
+      break;
+    }
   }
-  result = serial_start_device(&device_motors);
 
-  if (result != 0) {
-    return result;
+  if (!device_count) {
+    // Legacy configuration with a motors MCU and an accelerometer MCU.
+    serial_register_device(uci, "koruza.@mcu[0]", "/dev/ttyS1", SERIAL_ROLE_MOTORS);
+    serial_register_device(uci, "koruza.@accelerometer[0]", "/dev/ttyUSB0", SERIAL_ROLE_ACCELEROMETER);
   }
 
-  // Accelerometer MCU (can be disconnected).
-  device_accelerometer.ready = 0;
-  device_accelerometer.device = uci_get_string(uci, "koruza.@accelerometer[0].device");
-  if (!device_accelerometer.device) {
-    device_accelerometer.device = "/dev/ttyUSB0";
+  // Capture traffic of all devices when configured.
+  char *capture_path = uci_get_string(uci, "koruza.@capture[0].path");
+  if (capture_path) {
+    if (capture_open(&capture, capture_path) == 0) {
+      syslog(LOG_INFO, "Capturing serial traffic to '%s'.", capture_path);
+
+      uint64_t now = frame_timestamp_now();
+      for (int i = 0; i < device_count; i++) {
+        capture_write(&capture, i, CAPTURE_DEVICE_NAME, now, (const uint8_t*) devices[i].name,
+          strlen(devices[i].name));
+      }
+    } else {
+      syslog(LOG_ERR, "Failed to open capture file '%s'.", capture_path);
+    }
+    free(capture_path);
+  }
+
+  serial_hotplug_init();
+
+  for (int i = 0; i < device_count; i++) {
+    // Optional devices (like the accelerometer) can be disconnected.
+    if (serial_start_device(&devices[i]) != 0 && devices[i].required) {
+      return -1;
+    }
   }
-  (void) serial_start_device(&device_accelerometer);
 
   return 0;
 }
 
-struct serial_device *serial_get_device(serial_device_t device)
+int serial_register_device(struct uci_context *uci, const char *section, const char *device, serial_role_t role)
 {
-  switch (device) {
-    case DEVICE_MOTORS: return &device_motors;
-    case DEVICE_ACCELEROMETER: return &device_accelerometer;
-    default: return NULL;
+  char location[128];
+
+  snprintf(location, sizeof(location), "%s.device", section);
+  char *path = uci_get_string(uci, location);
+  if (!path && !device) {
+    return -1;
+  }
+
+  if (device_count >= SERIAL_MAX_DEVICES) {
+    syslog(LOG_WARNING, "Ignoring serial device '%s' as too many devices are configured.", path ? path : device);
+    free(path);
+    return -1;
+  }
+
+  struct serial_device *cfg = &devices[device_count];
+  memset(cfg, 0, sizeof(*cfg));
+  cfg->id = device_count;
+  cfg->ufd.fd = -1;
+  cfg->watch = -1;
+  cfg->retry.cb = serial_retry_handler;
+  cfg->retry_interval = SERIAL_RETRY_INTERVAL_MIN;
+  cfg->device = path ? path : strdup(device);
+
+  snprintf(location, sizeof(location), "%s.role", section);
+  char *role_name = uci_get_string(uci, location);
+  cfg->role = role_name ? serial_parse_role(role_name) : role;
+  free(role_name);
+  if (cfg->role == SERIAL_ROLE_NONE) {
+    cfg->role = SERIAL_ROLE_SENSOR;
+  }
+
+  // Devices are named after their role unless configured otherwise.
+  snprintf(location, sizeof(location), "%s.name", section);
+  cfg->name = uci_get_string(uci, location);
+  if (!cfg->name) {
+    if (serial_find_device(cfg->role) == SERIAL_DEVICE_NONE) {
+      cfg->name = strdup(serial_role_names[cfg->role]);
+    } else {
+      snprintf(location, sizeof(location), "%s%d", serial_role_names[cfg->role], cfg->id);
+      cfg->name = strdup(location);
+    }
   }
+
+  snprintf(location, sizeof(location), "%s.required", section);
+  cfg->required = uci_get_int(uci, location, cfg->role == SERIAL_ROLE_MOTORS);
+  snprintf(location, sizeof(location), "%s.max_frame_length", section);
+  cfg->max_frame_length = uci_get_int(uci, location, SERIAL_MAX_FRAME_LENGTH);
+  snprintf(location, sizeof(location), "%s.baudrate", section);
+  cfg->baudrate = uci_get_int(uci, location, SERIAL_BAUDRATE);
+  // USB-serial adapters otherwise buffer received data, so they default to
+  // the low latency profile.
+  snprintf(location, sizeof(location), "%s.low_latency", section);
+  cfg->low_latency = uci_get_int(uci, location,
+    strncmp(cfg->device, "/dev/ttyUSB", 11) == 0 || strncmp(cfg->device, "/dev/ttyACM", 11) == 0);
+
+  device_count++;
+  return 0;
 }
 
-struct serial_device *serial_get_device_fd(int fd)
+serial_role_t serial_parse_role(const char *role)
 {
-  if (fd == device_motors.ufd.fd) {
-    return &device_motors;
-  } else if (fd == device_accelerometer.ufd.fd) {
-    return &device_accelerometer;
-  } else {
+  for (size_t i = 0; i < sizeof(serial_role_names) / sizeof(serial_role_names[0]); i++) {
+    if (strcmp(role, serial_role_names[i]) == 0) {
+      return (serial_role_t) i;
+    }
+  }
+
+  syslog(LOG_WARNING, "Unknown serial device role '%s'.", role);
+  return SERIAL_ROLE_NONE;
+}
+
+struct serial_device *serial_get_device(serial_device_t device)
+{
+  if (device < 0 || device >= device_count) {
     return NULL;
   }
+
+  return &devices[device];
+}
+
+serial_device_t serial_find_device(serial_role_t role)
+{
+  for (int i = 0; i < device_count; i++) {
+    if (devices[i].role == role) {
+      return i;
+    }
+  }
+
+  return SERIAL_DEVICE_NONE;
+}
+
+int serial_get_device_count(void)
+{
+  return device_count;
+}
+
+const char *serial_get_device_name(serial_device_t device)
+{
+  struct serial_device *cfg = serial_get_device(device);
+  return cfg ? cfg->name : NULL;
 }
 
-void serial_set_message_handler(serial_device_t device, frame_message_handler handler)
+serial_role_t serial_get_device_role(serial_device_t device)
+{
+  struct serial_device *cfg = serial_get_device(device);
+  return cfg ? cfg->role : SERIAL_ROLE_NONE;
+}
+
+void serial_set_message_handler(serial_device_t device, frame_message_handler handler, void *context)
 {
   struct serial_device *cfg = serial_get_device(device);
   if (!cfg) {
@@ -107,12 +293,172 @@ void serial_set_message_handler(serial_device_t device, frame_message_handler ha
   }
 
   cfg->parser.handler = handler;
+  cfg->parser.context = context;
+}
+
+void serial_set_disconnect_handler(serial_device_t device, serial_disconnect_handler handler, void *context)
+{
+  struct serial_device *cfg = serial_get_device(device);
+  if (!cfg) {
+    syslog(LOG_ERR, "Failed to set disconnect handler for serial device %d", device);
+    return;
+  }
+
+  cfg->disconnect_handler = handler;
+  cfg->disconnect_context = context;
+}
+
+int serial_is_ready(serial_device_t device)
+{
+  struct serial_device *cfg = serial_get_device(device);
+  return cfg ? cfg->ready : 0;
+}
+
+int serial_get_statistics(serial_device_t device, struct serial_statistics *statistics)
+{
+  struct serial_device *cfg = serial_get_device(device);
+  if (!cfg) {
+    return -1;
+  }
+
+  *statistics = cfg->statistics;
+  statistics->connected = cfg->ready;
+  statistics->queue_length = cfg->tx_length;
+  statistics->parser = cfg->parser.statistics;
+  return 0;
 }
 
 int serial_start_device(struct serial_device *cfg)
 {
-  frame_parser_init(&cfg->parser);
-  return serial_init_device(cfg, 0);
+  memset(&cfg->statistics, 0, sizeof(cfg->statistics));
+  // Use a fixed-size frame buffer, so a burst of line noise cannot inflate it.
+  frame_parser_init_fixed(&cfg->parser, cfg->max_frame_length);
+  cfg->attach_time = frame_timestamp_now();
+  if (serial_init_device(cfg, 0) != 0) {
+    serial_schedule_open(cfg);
+    return -1;
+  }
+
+  return 0;
+}
+
+int serial_hotplug_init(void)
+{
+  hotplug_ufd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (hotplug_ufd.fd < 0) {
+    syslog(LOG_WARNING, "Failed to initialize serial device hotplug, devices will be polled.");
+    return -1;
+  }
+
+  // Watch directories containing device nodes. Watching the same directory
+  // again returns the same watch descriptor.
+  int watches = 0;
+  for (int i = 0; i < device_count; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", devices[i].device);
+
+    devices[i].watch = inotify_add_watch(hotplug_ufd.fd, dirname(path), SERIAL_HOTPLUG_EVENTS);
+    if (devices[i].watch < 0) {
+      syslog(LOG_WARNING, "Failed to watch serial device '%s', it will be polled.", devices[i].device);
+      continue;
+    }
+
+    watches++;
+  }
+
+  if (!watches) {
+    close(hotplug_ufd.fd);
+    hotplug_ufd.fd = -1;
+    return -1;
+  }
+
+  hotplug_ufd.cb = serial_hotplug_handler;
+  uloop_fd_add(&hotplug_ufd, ULOOP_READ);
+  return 0;
+}
+
+void serial_hotplug_handler(struct uloop_fd *ufd, unsigned int events)
+{
+  uint8_t buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  for (;;) {
+    ssize_t size = read(ufd->fd, buffer, sizeof(buffer));
+    if (size < 0 && errno == EINTR) {
+      continue;
+    } else if (size <= 0) {
+      return;
+    }
+
+    uint64_t now = frame_timestamp_now();
+    for (uint8_t *ptr = buffer; ptr < buffer + size;) {
+      const struct inotify_event *event = (const struct inotify_event*) ptr;
+      ptr += sizeof(struct inotify_event) + event->len;
+      if (!event->len) {
+        continue;
+      }
+
+      for (int i = 0; i < device_count; i++) {
+        struct serial_device *cfg = &devices[i];
+        const char *name = strrchr(cfg->device, '/');
+        if (cfg->watch != event->wd || strcmp(name ? name + 1 : cfg->device, event->name) != 0) {
+          continue;
+        }
+
+        if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+          if (cfg->ready) {
+            syslog(LOG_WARNING, "Serial device '%s' has been removed.", cfg->device);
+            serial_close_device(cfg);
+          }
+          continue;
+        }
+
+        if (cfg->ready) {
+          continue;
+        }
+
+        // The node may only become accessible after its permissions are set, in
+        // which case opening is retried.
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+          cfg->attach_time = now;
+        }
+        cfg->retry_interval = SERIAL_RETRY_INTERVAL_MIN;
+        if (serial_init_device(cfg, 1) != 0) {
+          serial_schedule_open(cfg);
+        }
+      }
+    }
+  }
+}
+
+void serial_schedule_open(struct serial_device *cfg)
+{
+  // Missing devices in watched directories are opened once their node appears.
+  if (cfg->watch >= 0 && access(cfg->device, F_OK) != 0) {
+    uloop_timeout_cancel(&cfg->retry);
+    return;
+  }
+
+  uloop_timeout_set(&cfg->retry, cfg->retry_interval);
+  cfg->retry_interval *= 2;
+  if (cfg->retry_interval > SERIAL_RETRY_INTERVAL_MAX) {
+    cfg->retry_interval = SERIAL_RETRY_INTERVAL_MAX;
+  }
+}
+
+void serial_retry_handler(struct uloop_timeout *timeout)
+{
+  struct serial_device *cfg = container_of(timeout, struct serial_device, retry);
+  if (cfg->ready) {
+    return;
+  }
+
+  if (!cfg->attach_time) {
+    cfg->attach_time = frame_timestamp_now();
+  }
+
+  if (serial_init_device(cfg, 1) != 0) {
+    serial_schedule_open(cfg);
+  }
 }
 
 int serial_init_device(struct serial_device *cfg, int quiet)
@@ -121,11 +467,12 @@ int serial_init_device(struct serial_device *cfg, int quiet)
     return -1;
   }
 
-  cfg->ufd.fd = open(cfg->device, O_RDWR | O_CLOEXEC);
+  cfg->ufd.fd = open(cfg->device, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
   if (cfg->ufd.fd < 0) {
     if (!quiet) {
       syslog(LOG_ERR, "Failed to open serial device '%s'.", cfg->device);
     }
+    cfg->ufd.fd = -1;
     return -1;
   }
 
@@ -136,6 +483,7 @@ int serial_init_device(struct serial_device *cfg, int quiet)
         cfg->device, strerror(errno), errno);
     }
     close(cfg->ufd.fd);
+    cfg->ufd.fd = -1;
     return -1;
   }
 
@@ -149,11 +497,37 @@ int serial_init_device(struct serial_device *cfg, int quiet)
         cfg->device, strerror(errno), errno);
     }
     close(cfg->ufd.fd);
+    cfg->ufd.fd = -1;
     return -1;
   }
 
+  // Speeds without a termios constant are set separately.
+  if (cfg->baudrate != SERIAL_BAUDRATE && serial_port_set_baudrate(cfg->ufd.fd, cfg->baudrate) != 0) {
+    if (!quiet) {
+      syslog(LOG_ERR, "Failed to set speed %u for serial device '%s': %s (%d)",
+        cfg->baudrate, cfg->device, strerror(errno), errno);
+    }
+    close(cfg->ufd.fd);
+    cfg->ufd.fd = -1;
+    return -1;
+  }
+
+  if (cfg->low_latency && serial_port_set_low_latency(cfg->ufd.fd, cfg->device) != 0 && !quiet) {
+    syslog(LOG_WARNING, "Failed to enable low latency mode for serial device '%s'.", cfg->device);
+  }
+
   cfg->ready = 1;
   cfg->ufd.cb = serial_fd_handler;
+  // Anything queued for the previous connection is dropped.
+  cfg->tx_head = 0;
+  cfg->tx_length = 0;
+  cfg->retry_interval = SERIAL_RETRY_INTERVAL_MIN;
+  uloop_timeout_cancel(&cfg->retry);
+  cfg->statistics.connects++;
+  if (!cfg->attach_time) {
+    cfg->attach_time = frame_timestamp_now();
+  }
+  cfg->attach_frames = cfg->parser.statistics.frames;
 
   uloop_fd_add(&cfg->ufd, ULOOP_READ);
 
@@ -162,63 +536,193 @@ int serial_init_device(struct serial_device *cfg, int quiet)
   return 0;
 }
 
-int serial_reinit_device(struct serial_device *cfg)
+void serial_close_device(struct serial_device *cfg)
 {
   cfg->ready = 0;
   uloop_fd_delete(&cfg->ufd);
   close(cfg->ufd.fd);
+  cfg->ufd.fd = -1;
+  cfg->attach_time = 0;
+  cfg->statistics.disconnects++;
+
+  // The device is reopened once it reappears.
+  serial_schedule_open(cfg);
 
-  return serial_init_device(cfg, 1);
+  if (cfg->disconnect_handler) {
+    cfg->disconnect_handler(cfg->id, cfg->disconnect_context);
+  }
 }
 
 void serial_fd_handler(struct uloop_fd *ufd, unsigned int events)
 {
-  struct serial_device *cfg = serial_get_device_fd(ufd->fd);
-  if (!cfg || !cfg->ready) {
+  struct serial_device *cfg = container_of(ufd, struct serial_device, ufd);
+  if (!cfg->ready) {
     return;
   }
 
-  uint8_t buffer[1024];
-  ssize_t size = read(cfg->ufd.fd, buffer, sizeof(buffer));
-  if (size < 0) {
-    syslog(LOG_ERR, "Failed to read from serial device.");
-    serial_reinit_device(cfg);
+  if (events & ULOOP_WRITE) {
+    if (serial_flush_device(cfg) != 0) {
+      return;
+    }
+  }
+
+  if (!(events & ULOOP_READ)) {
     return;
   }
 
-  frame_parser_push_buffer(&cfg->parser, buffer, size);
+  // Drain everything the kernel has buffered, so a burst does not have to
+  // wait for further loop iterations.
+  for (;;) {
+    uint8_t buffer[SERIAL_READ_BUFFER_SIZE];
+    ssize_t size = read(cfg->ufd.fd, buffer, sizeof(buffer));
+    uint64_t timestamp = frame_timestamp_now();
+    if (size < 0 && errno == EINTR) {
+      continue;
+    } else if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    } else if (size <= 0) {
+      // Reads return zero once a USB-serial adapter is unplugged.
+      syslog(LOG_ERR, "Failed to read from serial device '%s'.", cfg->device);
+      cfg->statistics.read_errors++;
+      serial_close_device(cfg);
+      return;
+    }
+
+    if (capture.fd >= 0) {
+      capture_write(&capture, cfg->id, CAPTURE_RX, timestamp, buffer, size);
+    }
+
+    frame_parser_push_buffer_at(&cfg->parser, buffer, size, timestamp);
+
+    // Handlers may send messages, and a failed write closes the device.
+    if (!cfg->ready) {
+      return;
+    }
+
+    if (cfg->attach_time && cfg->parser.statistics.frames != cfg->attach_frames) {
+      cfg->statistics.attach_latency = timestamp - cfg->attach_time;
+      cfg->attach_time = 0;
+      syslog(LOG_INFO, "Received first frame from serial device '%s' %llu ms after it was attached.",
+        cfg->device, (unsigned long long) cfg->statistics.attach_latency / 1000000);
+    }
+
+    // A short read means the kernel buffer is empty.
+    if (size < (ssize_t) sizeof(buffer)) {
+      return;
+    }
+  }
 }
 
 int serial_send_message(serial_device_t device, const message_t *message)
+{
+  // Commands are small, so they are framed on the stack unless the worst-case
+  // frame size does not fit.
+  uint8_t stack_buffer[SERIAL_FRAME_BUFFER_SIZE];
+  uint8_t *buffer = stack_buffer;
+  size_t buffer_size = frame_message_max_size(message) + FRAME_CHECKSUM_MAX_SIZE;
+  if (buffer_size > sizeof(stack_buffer)) {
+    buffer = (uint8_t*) malloc(buffer_size);
+    if (!buffer) {
+      return SERIAL_ERROR_OUT_OF_MEMORY;
+    }
+  } else {
+    buffer_size = sizeof(stack_buffer);
+  }
+
+  int result = SERIAL_ERROR_FRAMING;
+  ssize_t size = frame_message_checksum(buffer, buffer_size, message);
+  if (size >= 0) {
+    result = serial_send_frame(device, buffer, size);
+  }
+
+  if (buffer != stack_buffer) {
+    free(buffer);
+  }
+
+  return result;
+}
+
+int serial_send_frame(serial_device_t device, const uint8_t *frame, size_t length)
 {
   struct serial_device *cfg = serial_get_device(device);
-  if (!cfg || !cfg->ready) {
-    serial_reinit_device(cfg);
-    return -1;
+  if (!cfg) {
+    return SERIAL_ERROR_NOT_READY;
   }
 
-  if (cfg->ufd.fd < 0) {
-    serial_reinit_device(cfg);
-    return -1;
+  // Disconnected devices are reopened by the hotplug watcher.
+  if (!cfg->ready || cfg->ufd.fd < 0) {
+    return SERIAL_ERROR_NOT_READY;
   }
 
-  static uint8_t buffer[FRAME_MAX_LENGTH];
-  ssize_t size = frame_message(buffer, sizeof(buffer), message);
-  if (size < 0) {
-    return -1;
+  if (length > SERIAL_TX_QUEUE_SIZE) {
+    return SERIAL_ERROR_FRAME_TOO_LARGE;
   }
 
-  size_t offset = 0;
-  while (offset < size) {
-    ssize_t written = write(cfg->ufd.fd, &buffer[offset], size - offset);
+  if (length > SERIAL_TX_QUEUE_SIZE - cfg->tx_length) {
+    cfg->statistics.queue_full++;
+    return SERIAL_ERROR_QUEUE_FULL;
+  }
+
+  // Append the frame to the queue, wrapping around at the end.
+  size_t tail = (cfg->tx_head + cfg->tx_length) % SERIAL_TX_QUEUE_SIZE;
+  size_t chunk = SERIAL_TX_QUEUE_SIZE - tail;
+  if (chunk > length) {
+    chunk = length;
+  }
+  memcpy(&cfg->tx_queue[tail], frame, chunk);
+  memcpy(&cfg->tx_queue[0], frame + chunk, length - chunk);
+  cfg->tx_length += length;
+  cfg->statistics.frames_out++;
+
+  // Start transmitting right away, whatever does not fit into the kernel
+  // buffer is written once the device becomes writable again.
+  if (serial_flush_device(cfg) != 0) {
+    return SERIAL_ERROR_NOT_READY;
+  }
+
+  return SERIAL_SUCCESS;
+}
+
+int serial_flush_device(struct serial_device *cfg)
+{
+  while (cfg->tx_length > 0) {
+    size_t chunk = SERIAL_TX_QUEUE_SIZE - cfg->tx_head;
+    if (chunk > cfg->tx_length) {
+      chunk = cfg->tx_length;
+    }
+
+    ssize_t written = write(cfg->ufd.fd, &cfg->tx_queue[cfg->tx_head], chunk);
     if (written < 0) {
-      syslog(LOG_ERR, "Failed to write frame (%ld bytes) to serial device: %s (%d)",
-        (long int) size, strerror(errno), errno);
-      serial_reinit_device(cfg);
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+
+      syslog(LOG_ERR, "Failed to write to serial device '%s': %s (%d)",
+        cfg->device, strerror(errno), errno);
+      cfg->statistics.write_errors++;
+      serial_close_device(cfg);
       return -1;
     }
 
-    offset += written;
+    if (capture.fd >= 0) {
+      capture_write(&capture, cfg->id, CAPTURE_TX, frame_timestamp_now(), &cfg->tx_queue[cfg->tx_head], written);
+    }
+
+    cfg->tx_head = (cfg->tx_head + written) % SERIAL_TX_QUEUE_SIZE;
+    cfg->tx_length -= written;
+    cfg->statistics.bytes_out += written;
+  }
+
+  if (!cfg->tx_length) {
+    cfg->tx_head = 0;
+  }
+
+  // Only poll for writability while there is something queued.
+  unsigned int flags = ULOOP_READ | (cfg->tx_length ? ULOOP_WRITE : 0);
+  if (cfg->ufd.flags != flags) {
+    uloop_fd_add(&cfg->ufd, flags);
   }
 
   return 0;
@@ -24,16 +24,108 @@
 #include "message.h"
 #include "frame.h"
 
+// Maximum number of serial devices.
+#define SERIAL_MAX_DEVICES 8
+
+/**
+ * Serial device identifier (index into the device registry).
+ */
+typedef int serial_device_t;
+
+// Identifier that does not refer to any device.
+#define SERIAL_DEVICE_NONE -1
+
+/**
+ * Serial device roles.
+ */
+typedef enum {
+  SERIAL_ROLE_NONE = 0,
+  // Motor driver MCU.
+  SERIAL_ROLE_MOTORS,
+  // Accelerometer MCU.
+  SERIAL_ROLE_ACCELEROMETER,
+  // Any other sensor MCU using the same protocol.
+  SERIAL_ROLE_SENSOR,
+} serial_role_t;
+
+/**
+ * Handler called when a device is closed, e.g. because it was unplugged.
+ *
+ * @param device Device that was closed
+ * @param context Opaque context given when setting the handler
+ */
+typedef void (*serial_disconnect_handler)(serial_device_t device, void *context);
+
 /**
- * Supported devices.
+ * Serial transmit results.
  */
 typedef enum {
-  DEVICE_MOTORS,
-  DEVICE_ACCELEROMETER
-} serial_device_t;
+  SERIAL_SUCCESS = 0,
+  // Device is not connected or could not be (re)initialized.
+  SERIAL_ERROR_NOT_READY = -1,
+  // Transmit queue does not have enough space for the frame.
+  SERIAL_ERROR_QUEUE_FULL = -2,
+  // Frame is larger than the whole transmit queue.
+  SERIAL_ERROR_FRAME_TOO_LARGE = -3,
+  SERIAL_ERROR_OUT_OF_MEMORY = -4,
+  SERIAL_ERROR_FRAMING = -5,
+} serial_result_t;
+
+/**
+ * Serial device statistics.
+ */
+struct serial_statistics {
+  // Number of bytes and frames written to the device.
+  uint64_t bytes_out;
+  uint64_t frames_out;
+  // Number of failed writes.
+  uint64_t write_errors;
+  // Number of frames rejected because the transmit queue was full.
+  uint64_t queue_full;
+  // Number of bytes currently waiting in the transmit queue.
+  uint64_t queue_length;
+  // Number of failed reads.
+  uint64_t read_errors;
+  // Set while the device is open.
+  uint8_t connected;
+  // Number of times the device was opened and closed.
+  uint64_t connects;
+  uint64_t disconnects;
+  // Time from the device appearing to the first received frame for the last
+  // connection (in nanoseconds).
+  uint64_t attach_latency;
+  // Statistics of the receive side.
+  frame_parser_statistics_t parser;
+};
 
+// Registers and starts serial devices declared in koruza.@serial sections. When
+// there are none, the legacy koruza.@mcu and koruza.@accelerometer sections are
+// used instead.
 int serial_init(struct uci_context *uci);
+// Returns the first device with the given role or SERIAL_DEVICE_NONE.
+serial_device_t serial_find_device(serial_role_t role);
+// Returns the number of registered devices. Their identifiers are consecutive,
+// starting at zero.
+int serial_get_device_count(void);
+// Returns the name of a device or NULL for invalid devices.
+const char *serial_get_device_name(serial_device_t device);
+// Returns the role of a device.
+serial_role_t serial_get_device_role(serial_device_t device);
+// Frames and queues a message for transmission. A checksum TLV is appended
+// while framing, so the message itself should not contain one. Returns one
+// of the serial_result_t values.
 int serial_send_message(serial_device_t device, const message_t *message);
-void serial_set_message_handler(serial_device_t device, frame_message_handler handler);
+// Queues an already framed message for transmission. Frames are either
+// queued whole or rejected with SERIAL_ERROR_QUEUE_FULL.
+int serial_send_frame(serial_device_t device, const uint8_t *frame, size_t length);
+// Sets the handler for messages received from a device. The context is passed
+// to the handler in frame metadata.
+void serial_set_message_handler(serial_device_t device, frame_message_handler handler, void *context);
+// Sets the handler called when a device is closed.
+void serial_set_disconnect_handler(serial_device_t device, serial_disconnect_handler handler, void *context);
+// Returns non-zero while a device is open.
+int serial_is_ready(serial_device_t device);
+// Copies current statistics of a device into the given structure.
+int serial_get_statistics(serial_device_t device, struct serial_statistics *statistics);
 
 #endif
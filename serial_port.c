@@ -0,0 +1,121 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "serial_port.h"
+
+// The termios2 interface is declared by kernel headers, which conflict with
+// <termios.h>, so it is kept separate from the rest of the serial code.
+#include <asm/termbits.h>
+#include <linux/serial.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Latency timer of USB-serial adapters (FTDI and compatible).
+#define SERIAL_PORT_SYSFS_LATENCY_TIMER "/sys/bus/usb-serial/devices/%s/latency_timer"
+// Lowest supported latency timer value (in milliseconds).
+#define SERIAL_PORT_LATENCY_TIMER 1
+
+int serial_port_set_latency_timer(const char *device, int latency);
+
+int serial_port_set_baudrate(int fd, uint32_t baudrate)
+{
+  struct termios2 tio;
+  if (ioctl(fd, TCGETS2, &tio) < 0) {
+    return -1;
+  }
+
+  tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+  tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+  tio.c_ispeed = baudrate;
+  tio.c_ospeed = baudrate;
+
+  if (ioctl(fd, TCSETS2, &tio) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int serial_port_set_low_latency(int fd, const char *device)
+{
+  int result = -1;
+
+  // Deliver every received byte to readers as soon as it arrives.
+  struct termios2 tio;
+  if (ioctl(fd, TCGETS2, &tio) == 0) {
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    if (ioctl(fd, TCSETS2, &tio) == 0) {
+      result = 0;
+    }
+  }
+
+  // Not all drivers implement this, so failure is not an error.
+  struct serial_struct serial;
+  if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+    serial.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(fd, TIOCSSERIAL, &serial) == 0) {
+      result = 0;
+    }
+  }
+
+  // USB-serial adapters buffer received data for up to 16 ms by default.
+  if (serial_port_set_latency_timer(device, SERIAL_PORT_LATENCY_TIMER) == 0) {
+    result = 0;
+  }
+
+  return result;
+}
+
+int serial_port_set_latency_timer(const char *device, int latency)
+{
+  // The device may be a symlink (e.g. from udev rules), so resolve it first.
+  char resolved[PATH_MAX];
+  if (!realpath(device, resolved)) {
+    return -1;
+  }
+
+  const char *name = strrchr(resolved, '/');
+  name = name ? name + 1 : resolved;
+
+  char path[sizeof(SERIAL_PORT_SYSFS_LATENCY_TIMER) + NAME_MAX];
+  int length = snprintf(path, sizeof(path), SERIAL_PORT_SYSFS_LATENCY_TIMER, name);
+  if (length < 0 || (size_t) length >= sizeof(path)) {
+    return -1;
+  }
+
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  char buffer[16];
+  length = snprintf(buffer, sizeof(buffer), "%d", latency);
+  if (write(fd, buffer, length) != length) {
+    close(fd);
+    return -1;
+  }
+
+  close(fd);
+  return 0;
+}
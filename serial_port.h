@@ -0,0 +1,45 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_DRIVER_SERIAL_PORT_H
+#define KORUZA_DRIVER_SERIAL_PORT_H
+
+#include <stdint.h>
+
+/**
+ * Sets the line speed of a serial port. Any speed supported by the UART can
+ * be used, not only the standard ones defined by termios.
+ *
+ * @param fd Serial port file descriptor
+ * @param baudrate Line speed (in bits per second)
+ * @return Zero on success, -1 on failure
+ */
+int serial_port_set_baudrate(int fd, uint32_t baudrate);
+
+/**
+ * Configures a serial port for low receive latency. The driver is asked
+ * to push received bytes to the line discipline immediately and, for
+ * USB-serial adapters, the adapter latency timer is lowered.
+ *
+ * @param fd Serial port file descriptor
+ * @param device Path to the serial device
+ * @return Zero on success, -1 when no setting could be applied
+ */
+int serial_port_set_low_latency(int fd, const char *device);
+
+#endif
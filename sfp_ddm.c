@@ -0,0 +1,133 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "sfp_ddm.h"
+
+#include <fcntl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Diagnostic monitoring type in the A0h page.
+#define SFP_DDM_MONITORING_TYPE 92
+#define SFP_DDM_MONITORING_IMPLEMENTED 0x40
+#define SFP_DDM_MONITORING_INTERNAL 0x20
+// Real-time diagnostic values in the A2h page.
+#define SFP_DDM_VALUES 96
+#define SFP_DDM_VALUES_LENGTH 10
+
+int sfp_ddm_monitoring_supported(uint8_t type);
+
+int sfp_ddm_open(sfp_ddm_reader_t *reader, const char *device)
+{
+  reader->fd = open(device, O_RDWR | O_CLOEXEC);
+  if (reader->fd < 0) {
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(reader->fd, &st) != 0) {
+    sfp_ddm_close(reader);
+    return -1;
+  }
+  reader->fake = S_ISREG(st.st_mode);
+  return 0;
+}
+
+void sfp_ddm_close(sfp_ddm_reader_t *reader)
+{
+  if (reader->fd >= 0) {
+    close(reader->fd);
+  }
+  reader->fd = -1;
+}
+
+int sfp_ddm_monitoring_supported(uint8_t type)
+{
+  // Externally calibrated modules require floating-point conversion, so they
+  // are not supported.
+  return (type & SFP_DDM_MONITORING_IMPLEMENTED) && (type & SFP_DDM_MONITORING_INTERNAL);
+}
+
+int sfp_ddm_read(sfp_ddm_reader_t *reader, sfp_ddm_t *ddm)
+{
+  if (reader->fd < 0) {
+    return -1;
+  }
+
+  uint8_t type;
+  uint8_t data[SFP_DDM_VALUES_LENGTH];
+  if (reader->fake) {
+    if (pread(reader->fd, &type, sizeof(type), SFP_DDM_MONITORING_TYPE) != sizeof(type) ||
+        pread(reader->fd, data, sizeof(data), SFP_DDM_PAGE_SIZE + SFP_DDM_VALUES) != sizeof(data)) {
+      return -1;
+    }
+  } else {
+    // Modules may be swapped at any time, so the monitoring type is read
+    // together with the values, setting each offset in the same transfer.
+    uint8_t type_offset = SFP_DDM_MONITORING_TYPE;
+    uint8_t values_offset = SFP_DDM_VALUES;
+    struct i2c_msg messages[4] = {
+      { .addr = SFP_DDM_ADDRESS_ID, .flags = 0, .len = 1, .buf = &type_offset },
+      { .addr = SFP_DDM_ADDRESS_ID, .flags = I2C_M_RD, .len = sizeof(type), .buf = &type },
+      { .addr = SFP_DDM_ADDRESS_DIAGNOSTICS, .flags = 0, .len = 1, .buf = &values_offset },
+      { .addr = SFP_DDM_ADDRESS_DIAGNOSTICS, .flags = I2C_M_RD, .len = sizeof(data), .buf = data },
+    };
+
+    struct i2c_rdwr_ioctl_data transfer;
+    transfer.msgs = messages;
+    transfer.nmsgs = 4;
+    if (ioctl(reader->fd, I2C_RDWR, &transfer) != 4) {
+      return -1;
+    }
+  }
+
+  if (!sfp_ddm_monitoring_supported(type)) {
+    return -1;
+  }
+
+  sfp_ddm_decode(data, ddm);
+  return 0;
+}
+
+void sfp_ddm_decode(const uint8_t *data, sfp_ddm_t *ddm)
+{
+  // Values are big-endian 16-bit words.
+  ddm->temperature = (int16_t) ((data[0] << 8) | data[1]);
+  ddm->vcc = (data[2] << 8) | data[3];
+  ddm->tx_bias = (data[4] << 8) | data[5];
+  ddm->tx_power = (data[6] << 8) | data[7];
+  ddm->rx_power = (data[8] << 8) | data[9];
+}
+
+int32_t sfp_ddm_temperature_mc(const sfp_ddm_t *ddm)
+{
+  return (int32_t) ddm->temperature * 1000 / 256;
+}
+
+uint32_t sfp_ddm_vcc_mv(const sfp_ddm_t *ddm)
+{
+  return ddm->vcc / 10;
+}
+
+uint32_t sfp_ddm_tx_bias_ua(const sfp_ddm_t *ddm)
+{
+  return (uint32_t) ddm->tx_bias * 2;
+}
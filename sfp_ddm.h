@@ -0,0 +1,109 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_DRIVER_SFP_DDM_H
+#define KORUZA_DRIVER_SFP_DDM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// I2C addresses of the SFF-8472 serial ID (A0h) and diagnostics (A2h) pages.
+#define SFP_DDM_ADDRESS_ID 0x50
+#define SFP_DDM_ADDRESS_DIAGNOSTICS 0x51
+// Size of a page, used as the stride of pages in fake devices.
+#define SFP_DDM_PAGE_SIZE 256
+
+/**
+ * Raw SFF-8472 real-time diagnostic values of an internally calibrated
+ * module, in the units defined by the specification.
+ */
+typedef struct {
+  // Temperature (in 1/256 degrees Celsius).
+  int16_t temperature;
+  // Supply voltage (in 100 uV).
+  uint16_t vcc;
+  // Laser bias current (in 2 uA).
+  uint16_t tx_bias;
+  // Transmitted and received optical power (in 0.1 uW).
+  uint16_t tx_power;
+  uint16_t rx_power;
+} sfp_ddm_t;
+
+/**
+ * Diagnostics reader. The device is either an I2C bus (e.g. /dev/i2c-1) or,
+ * for testing, a regular file containing the A0h page followed by the A2h
+ * page.
+ */
+typedef struct {
+  int fd;
+  // Set when the device is a regular file.
+  int fake;
+} sfp_ddm_reader_t;
+
+/**
+ * Opens an SFP diagnostics reader. The module does not have to be present.
+ *
+ * @param reader Reader instance
+ * @param device Path to the I2C bus or a fake device file
+ * @return Zero on success, -1 when the device cannot be opened
+ */
+int sfp_ddm_open(sfp_ddm_reader_t *reader, const char *device);
+
+/**
+ * Closes an SFP diagnostics reader.
+ *
+ * @param reader Reader instance
+ */
+void sfp_ddm_close(sfp_ddm_reader_t *reader);
+
+/**
+ * Reads real-time diagnostic values with a single combined transfer. The
+ * monitoring type of the module is read in the same transfer, as modules may
+ * be swapped at any time.
+ *
+ * @param reader Reader instance
+ * @param ddm Destination for the diagnostic values
+ * @return Zero on success, -1 on failure or when the module does not
+ *   implement internally calibrated diagnostics
+ */
+int sfp_ddm_read(sfp_ddm_reader_t *reader, sfp_ddm_t *ddm);
+
+/**
+ * Decodes real-time diagnostic values from the A2h page, starting at byte 96.
+ *
+ * @param data Raw diagnostic values (at least 10 bytes)
+ * @param ddm Destination for the diagnostic values
+ */
+void sfp_ddm_decode(const uint8_t *data, sfp_ddm_t *ddm);
+
+/**
+ * Returns the module temperature in millidegrees Celsius.
+ */
+int32_t sfp_ddm_temperature_mc(const sfp_ddm_t *ddm);
+
+/**
+ * Returns the supply voltage in millivolts.
+ */
+uint32_t sfp_ddm_vcc_mv(const sfp_ddm_t *ddm);
+
+/**
+ * Returns the laser bias current in microamperes.
+ */
+uint32_t sfp_ddm_tx_bias_ua(const sfp_ddm_t *ddm);
+
+#endif
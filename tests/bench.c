@@ -0,0 +1,392 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "frame.h"
+#include "crc32.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Number of messages in each corpus.
+#define BENCH_CORPUS_SIZE 64
+// Size of the stream buffers fed to the frame parser.
+#define BENCH_STREAM_SIZE (256 * 1024)
+
+/**
+ * Allocation counters, maintained by the linker-wrapped allocator below.
+ */
+static size_t bench_allocations;
+
+void *__real_malloc(size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_malloc(size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+  bench_allocations++;
+  return __real_malloc(size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+  bench_allocations++;
+  return __real_realloc(ptr, size);
+}
+
+/**
+ * Benchmark corpus.
+ */
+struct bench_corpus {
+  const char *name;
+  message_t messages[BENCH_CORPUS_SIZE];
+  uint8_t *serialized[BENCH_CORPUS_SIZE];
+  size_t serialized_length[BENCH_CORPUS_SIZE];
+  uint8_t *stream;
+  size_t stream_length;
+  size_t stream_frames;
+  size_t bytes;
+};
+
+struct bench_result {
+  const char *benchmark;
+  const char *corpus;
+  size_t iterations;
+  size_t bytes;
+  size_t frames;
+  size_t allocations;
+  double seconds;
+};
+
+// Minimum measurement time for each benchmark in seconds.
+static double bench_min_time = 0.2;
+// Number of frames decoded by the parser handler.
+static size_t bench_parsed_frames;
+
+static double bench_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static uint32_t bench_random(uint32_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+static void bench_report(const struct bench_result *result)
+{
+  double ns = result->seconds * 1e9;
+  printf("{\"benchmark\": \"%s\", \"corpus\": \"%s\", \"iterations\": %zu, \"bytes\": %zu, "
+         "\"frames\": %zu, \"ns_per_byte\": %.4f, \"ns_per_frame\": %.2f, \"mb_per_s\": %.2f, "
+         "\"allocations_per_frame\": %.3f}\n",
+    result->benchmark,
+    result->corpus,
+    result->iterations,
+    result->bytes,
+    result->frames,
+    result->bytes ? ns / (double) result->bytes : 0.0,
+    result->frames ? ns / (double) result->frames : 0.0,
+    result->bytes ? (double) result->bytes / result->seconds / 1e6 : 0.0,
+    result->frames ? (double) result->allocations / (double) result->frames : 0.0
+  );
+  fflush(stdout);
+}
+
+static void bench_parser_handler(const message_t *message, const frame_info_t *info)
+{
+  (void) message;
+  bench_parsed_frames++;
+}
+
+static void bench_build_status_report(message_t *message, uint32_t *state)
+{
+  tlv_motor_position_t position = {bench_random(state) % 50000, bench_random(state) % 50000, 0};
+  tlv_encoder_value_t encoder = {bench_random(state), bench_random(state)};
+
+  message_init(message);
+  message_tlv_add_reply(message, REPLY_STATUS_REPORT);
+  message_tlv_add_motor_position(message, &position);
+  message_tlv_add_encoder_value(message, &encoder);
+  message_tlv_add_checksum(message);
+}
+
+static void bench_build_vibration_report(message_t *message, uint32_t *state)
+{
+  tlv_vibration_value_t vibration;
+  uint32_t *words = (uint32_t*) &vibration;
+  for (size_t i = 0; i < sizeof(vibration) / sizeof(uint32_t); i++) {
+    words[i] = bench_random(state);
+  }
+
+  message_init(message);
+  message_tlv_add_reply(message, REPLY_STATUS_REPORT);
+  message_tlv_add_vibration_value(message, &vibration);
+  message_tlv_add_checksum(message);
+}
+
+static void bench_build_escapes(message_t *message, uint32_t *state)
+{
+  // Every serialized byte of this message is a frame marker.
+  uint8_t value[0xF1F1];
+  uint16_t length = (FRAME_MARKER_START << 8) | FRAME_MARKER_START;
+  memset(value, FRAME_MARKER_ESCAPE, length);
+
+  message_init(message);
+  message_tlv_add(message, FRAME_MARKER_END, length, value);
+}
+
+static void bench_build_corpus(struct bench_corpus *corpus, const char *name, uint32_t seed,
+                               void (*builder)(message_t *message, uint32_t *state),
+                               size_t count, double noise)
+{
+  uint32_t state = seed;
+
+  memset(corpus, 0, sizeof(*corpus));
+  corpus->name = name;
+  corpus->stream = (uint8_t*) malloc(BENCH_STREAM_SIZE);
+
+  for (size_t i = 0; i < count; i++) {
+    message_t *message = &corpus->messages[i];
+    builder(message, &state);
+
+    corpus->serialized_length[i] = message_serialized_size(message);
+    corpus->serialized[i] = (uint8_t*) malloc(corpus->serialized_length[i]);
+    message_serialize(corpus->serialized[i], corpus->serialized_length[i], message);
+    corpus->bytes += corpus->serialized_length[i];
+  }
+
+  // Build a stream of frames, optionally interleaved with line noise.
+  for (size_t i = 0; ; i = (i + 1) % count) {
+    const message_t *message = &corpus->messages[i];
+    size_t max_size = frame_message_max_size(message);
+    if (corpus->stream_length + max_size + 16 > BENCH_STREAM_SIZE) {
+      break;
+    }
+
+    if (noise > 0 && (double) (bench_random(&state) % 1000) < noise * 1000) {
+      size_t junk = bench_random(&state) % 16;
+      for (size_t j = 0; j < junk; j++) {
+        corpus->stream[corpus->stream_length++] = bench_random(&state);
+      }
+    }
+
+    ssize_t size = frame_message(corpus->stream + corpus->stream_length, max_size, message);
+    corpus->stream_length += size;
+    corpus->stream_frames++;
+  }
+}
+
+static void bench_free_corpus(struct bench_corpus *corpus, size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    message_free(&corpus->messages[i]);
+    free(corpus->serialized[i]);
+  }
+
+  free(corpus->stream);
+}
+
+#define BENCH_RUN(result, body) \
+  do { \
+    size_t _allocations = bench_allocations; \
+    double _start = bench_now(); \
+    double _elapsed; \
+    do { \
+      body; \
+      (result)->iterations++; \
+      _elapsed = bench_now() - _start; \
+    } while (_elapsed < bench_min_time); \
+    (result)->seconds = _elapsed; \
+    (result)->allocations = bench_allocations - _allocations; \
+  } while (0)
+
+static void bench_messages(struct bench_corpus *corpus, size_t count)
+{
+  uint8_t *buffer = (uint8_t*) malloc(BENCH_STREAM_SIZE);
+  struct bench_result result;
+
+  // Serialization.
+  memset(&result, 0, sizeof(result));
+  result.benchmark = "message_serialize";
+  result.corpus = corpus->name;
+  BENCH_RUN(&result, {
+    for (size_t i = 0; i < count; i++) {
+      message_serialize(buffer, BENCH_STREAM_SIZE, &corpus->messages[i]);
+    }
+  });
+  result.bytes = result.iterations * corpus->bytes;
+  result.frames = result.iterations * count;
+  bench_report(&result);
+
+  // Parsing with copied values.
+  memset(&result, 0, sizeof(result));
+  result.benchmark = "message_parse";
+  result.corpus = corpus->name;
+  BENCH_RUN(&result, {
+    for (size_t i = 0; i < count; i++) {
+      message_t message;
+      message_parse(&message, corpus->serialized[i], corpus->serialized_length[i]);
+      message_free(&message);
+    }
+  });
+  result.bytes = result.iterations * corpus->bytes;
+  result.frames = result.iterations * count;
+  bench_report(&result);
+
+  // Parsing with borrowed values.
+  memset(&result, 0, sizeof(result));
+  result.benchmark = "message_parse_view";
+  result.corpus = corpus->name;
+  BENCH_RUN(&result, {
+    for (size_t i = 0; i < count; i++) {
+      message_t message;
+      message_parse_view(&message, corpus->serialized[i], corpus->serialized_length[i]);
+    }
+  });
+  result.bytes = result.iterations * corpus->bytes;
+  result.frames = result.iterations * count;
+  bench_report(&result);
+
+  // Framing.
+  memset(&result, 0, sizeof(result));
+  result.benchmark = "frame_message";
+  result.corpus = corpus->name;
+  BENCH_RUN(&result, {
+    for (size_t i = 0; i < count; i++) {
+      frame_message(buffer, BENCH_STREAM_SIZE, &corpus->messages[i]);
+    }
+  });
+  result.bytes = result.iterations * corpus->bytes;
+  result.frames = result.iterations * count;
+  bench_report(&result);
+
+  // Frame parser.
+  parser_t parser;
+  frame_parser_init(&parser);
+  parser.handler = bench_parser_handler;
+  bench_parsed_frames = 0;
+
+  memset(&result, 0, sizeof(result));
+  result.benchmark = "frame_parser_push_buffer";
+  result.corpus = corpus->name;
+  BENCH_RUN(&result, {
+    frame_parser_push_buffer(&parser, corpus->stream, corpus->stream_length);
+  });
+  result.bytes = result.iterations * corpus->stream_length;
+  result.frames = bench_parsed_frames;
+  bench_report(&result);
+  frame_parser_free(&parser);
+
+  free(buffer);
+}
+
+static void bench_crc32()
+{
+  static const size_t sizes[] = {16, 256, 4096, 65536};
+  uint8_t *buffer = (uint8_t*) malloc(65536);
+  uint32_t state = 0x4b4f525a;
+  for (size_t i = 0; i < 65536; i++) {
+    buffer[i] = bench_random(&state);
+  }
+
+  char corpus[32];
+  for (crc32_backend_t backend = CRC32_BACKEND_BYTEWISE; backend < __CRC32_BACKEND_MAX; backend++) {
+    if (crc32_set_backend(backend) != 0) {
+      continue;
+    }
+
+    for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+      struct bench_result result;
+      volatile uint32_t checksum = 0;
+
+      memset(&result, 0, sizeof(result));
+      snprintf(corpus, sizeof(corpus), "random-%zu", sizes[j]);
+      result.benchmark = crc32_backend_name(backend);
+      result.corpus = corpus;
+      BENCH_RUN(&result, {
+        for (size_t k = 0; k < 65536 / sizes[j]; k++) {
+          checksum = crc32(checksum, buffer + k * sizes[j], sizes[j]);
+        }
+      });
+      result.bytes = result.iterations * 65536;
+      bench_report(&result);
+    }
+  }
+
+  crc32_init();
+  free(buffer);
+}
+
+static void bench_usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-t seconds] [-s seed] [-b crc32|messages]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t seed = 1;
+  const char *only = NULL;
+  int c;
+
+  while ((c = getopt(argc, argv, "t:s:b:h")) != -1) {
+    switch (c) {
+      case 't': bench_min_time = atof(optarg); break;
+      case 's': seed = strtoul(optarg, NULL, 0); break;
+      case 'b': only = optarg; break;
+      default: bench_usage(argv[0]); return 1;
+    }
+  }
+
+  if (!only || strcmp(only, "crc32") == 0) {
+    bench_crc32();
+  }
+
+  if (!only || strcmp(only, "messages") == 0) {
+    static struct bench_corpus corpus;
+
+    bench_build_corpus(&corpus, "status-fixed", 1, bench_build_status_report, 1, 0);
+    bench_messages(&corpus, 1);
+    bench_free_corpus(&corpus, 1);
+
+    bench_build_corpus(&corpus, "status-random", seed, bench_build_status_report, BENCH_CORPUS_SIZE, 0);
+    bench_messages(&corpus, BENCH_CORPUS_SIZE);
+    bench_free_corpus(&corpus, BENCH_CORPUS_SIZE);
+
+    bench_build_corpus(&corpus, "vibration-random", seed, bench_build_vibration_report, BENCH_CORPUS_SIZE, 0);
+    bench_messages(&corpus, BENCH_CORPUS_SIZE);
+    bench_free_corpus(&corpus, BENCH_CORPUS_SIZE);
+
+    bench_build_corpus(&corpus, "vibration-noisy", seed, bench_build_vibration_report, BENCH_CORPUS_SIZE, 0.2);
+    bench_messages(&corpus, BENCH_CORPUS_SIZE);
+    bench_free_corpus(&corpus, BENCH_CORPUS_SIZE);
+
+    bench_build_corpus(&corpus, "all-escapes", seed, bench_build_escapes, 1, 0);
+    bench_messages(&corpus, 1);
+    bench_free_corpus(&corpus, 1);
+  }
+
+  return 0;
+}
@@ -0,0 +1,468 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "frame.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+// Number of replies that can wait for their latency to pass.
+#define SIM_REPLY_QUEUE_SIZE 64
+// Maximum size of a framed reply.
+#define SIM_REPLY_MAX_SIZE 256
+// Size of a noise burst injected on SIGUSR1.
+#define SIM_NOISE_BURST 64
+// Time after which a stream subscription that was not renewed expires (in milliseconds).
+#define SIM_SUBSCRIPTION_TIMEOUT 5000
+// Interval at which motor motion is updated when idle (in milliseconds).
+#define SIM_TICK 10
+
+#define SIM_MS 1000000ULL
+
+/**
+ * Reply waiting to be written.
+ */
+struct sim_reply {
+  uint64_t due;
+  uint8_t frame[SIM_REPLY_MAX_SIZE];
+  size_t length;
+};
+
+/**
+ * Simulated MCU.
+ */
+struct sim_mcu {
+  // Set to simulate the accelerometer instead of the motor driver.
+  int accelerometer;
+  // Set to simulate firmware without sequence numbers and streaming.
+  int legacy;
+  // Reply latency (in nanoseconds).
+  uint64_t latency;
+  // Motor speed (in steps per second).
+  double speed;
+  // Line noise (in bytes per second).
+  double noise_rate;
+
+  int fd;
+  parser_t parser;
+  uint32_t random;
+
+  // Motor state.
+  double position[3];
+  int32_t target[3];
+  uint64_t last_update;
+
+  // Stream subscription.
+  uint16_t stream_interval;
+  uint64_t stream_expires;
+  uint64_t stream_next;
+
+  uint64_t next_noise;
+
+  struct sim_reply replies[SIM_REPLY_QUEUE_SIZE];
+  size_t reply_head;
+  size_t reply_count;
+
+  // Statistics.
+  uint64_t requests;
+  uint64_t replies_sent;
+  uint64_t noise_bytes;
+};
+
+static volatile sig_atomic_t sim_noise_requested;
+static volatile sig_atomic_t sim_exit_requested;
+
+static void sim_signal_handler(int signal)
+{
+  if (signal == SIGUSR1) {
+    sim_noise_requested = 1;
+  } else {
+    sim_exit_requested = 1;
+  }
+}
+
+static uint32_t sim_random(struct sim_mcu *mcu)
+{
+  // Xorshift, so runs with the same seed produce the same noise.
+  mcu->random ^= mcu->random << 13;
+  mcu->random ^= mcu->random >> 17;
+  mcu->random ^= mcu->random << 5;
+  return mcu->random;
+}
+
+static void sim_update_motors(struct sim_mcu *mcu, uint64_t now)
+{
+  double step = mcu->speed * (now - mcu->last_update) / 1e9;
+  mcu->last_update = now;
+
+  for (int i = 0; i < 3; i++) {
+    double distance = mcu->target[i] - mcu->position[i];
+    if (distance > step) {
+      mcu->position[i] += step;
+    } else if (distance < -step) {
+      mcu->position[i] -= step;
+    } else {
+      mcu->position[i] = mcu->target[i];
+    }
+  }
+}
+
+static void sim_queue_reply(struct sim_mcu *mcu, const message_t *message, uint64_t now)
+{
+  if (mcu->reply_count == SIM_REPLY_QUEUE_SIZE) {
+    fprintf(stderr, "Reply queue is full, dropping reply.\n");
+    return;
+  }
+
+  struct sim_reply *reply = &mcu->replies[(mcu->reply_head + mcu->reply_count) % SIM_REPLY_QUEUE_SIZE];
+  ssize_t length = frame_message_checksum(reply->frame, sizeof(reply->frame), message);
+  if (length < 0) {
+    fprintf(stderr, "Failed to frame reply.\n");
+    return;
+  }
+
+  reply->length = length;
+  reply->due = now + mcu->latency;
+  mcu->reply_count++;
+}
+
+static void sim_queue_status_report(struct sim_mcu *mcu, const uint16_t *sequence, uint64_t now)
+{
+  message_t msg;
+  uint8_t arena[MESSAGE_ARENA_SIZE];
+  message_init_arena(&msg, arena, sizeof(arena));
+  message_tlv_add_reply(&msg, REPLY_STATUS_REPORT);
+
+  if (mcu->accelerometer) {
+    tlv_vibration_value_t vibration;
+    for (int i = 0; i < 4; i++) {
+      vibration.avg_x[i] = sim_random(mcu) % 100;
+      vibration.avg_y[i] = sim_random(mcu) % 100;
+      vibration.avg_z[i] = sim_random(mcu) % 100;
+      vibration.max_x[i] = vibration.avg_x[i] + sim_random(mcu) % 100;
+      vibration.max_y[i] = vibration.avg_y[i] + sim_random(mcu) % 100;
+      vibration.max_z[i] = vibration.avg_z[i] + sim_random(mcu) % 100;
+    }
+    message_tlv_add_vibration_value(&msg, &vibration);
+  } else {
+    sim_update_motors(mcu, now);
+
+    tlv_motor_position_t position;
+    position.x = (int32_t) mcu->position[0];
+    position.y = (int32_t) mcu->position[1];
+    position.z = (int32_t) mcu->position[2];
+    message_tlv_add_motor_position(&msg, &position);
+
+    // Encoders are a few steps off the commanded position.
+    tlv_encoder_value_t encoder;
+    encoder.x = position.x + (int32_t) (sim_random(mcu) % 5) - 2;
+    encoder.y = position.y + (int32_t) (sim_random(mcu) % 5) - 2;
+    message_tlv_add_encoder_value(&msg, &encoder);
+  }
+
+  if (sequence) {
+    message_tlv_add_sequence(&msg, *sequence);
+  }
+
+  sim_queue_reply(mcu, &msg, now);
+  message_free(&msg);
+}
+
+static void sim_message_handler(const message_t *message, const frame_info_t *info)
+{
+  struct sim_mcu *mcu = (struct sim_mcu*) info->context;
+  message_report_t report;
+  if (message_decode(message, &report) != MESSAGE_SUCCESS || !MESSAGE_REPORT_HAS(&report, COMMAND)) {
+    return;
+  }
+
+  mcu->requests++;
+
+  // Legacy firmware ignores sequence numbers.
+  const uint16_t *sequence = NULL;
+  if (!mcu->legacy && MESSAGE_REPORT_HAS(&report, SEQUENCE)) {
+    sequence = &report.sequence;
+  }
+
+  switch (report.command) {
+    case COMMAND_GET_STATUS: {
+      sim_queue_status_report(mcu, sequence, info->last_byte);
+      return;
+    }
+
+    case COMMAND_MOVE_MOTOR: {
+      if (mcu->accelerometer || !MESSAGE_REPORT_HAS(&report, MOTOR_POSITION)) {
+        return;
+      }
+
+      sim_update_motors(mcu, info->last_byte);
+      mcu->target[0] = report.motor_position.x;
+      mcu->target[1] = report.motor_position.y;
+      mcu->target[2] = report.motor_position.z;
+      break;
+    }
+
+    case COMMAND_HOMING: {
+      if (mcu->accelerometer) {
+        return;
+      }
+
+      sim_update_motors(mcu, info->last_byte);
+      memset(mcu->target, 0, sizeof(mcu->target));
+      break;
+    }
+
+    case COMMAND_RESTORE_MOTOR: {
+      if (mcu->accelerometer || !MESSAGE_REPORT_HAS(&report, MOTOR_POSITION)) {
+        return;
+      }
+
+      mcu->target[0] = report.motor_position.x;
+      mcu->target[1] = report.motor_position.y;
+      mcu->target[2] = report.motor_position.z;
+      for (int i = 0; i < 3; i++) {
+        mcu->position[i] = mcu->target[i];
+      }
+      break;
+    }
+
+    case COMMAND_SUBSCRIBE: {
+      if (mcu->legacy || !MESSAGE_REPORT_HAS(&report, INTERVAL) || !report.interval) {
+        return;
+      }
+
+      if (mcu->stream_interval != report.interval || info->last_byte > mcu->stream_expires) {
+        mcu->stream_next = info->last_byte + report.interval * SIM_MS;
+      }
+      mcu->stream_interval = report.interval;
+      mcu->stream_expires = info->last_byte + SIM_SUBSCRIPTION_TIMEOUT * SIM_MS;
+      break;
+    }
+
+    default: {
+      return;
+    }
+  }
+
+  // Commands are only acknowledged by firmware that echoes sequence numbers.
+  if (sequence) {
+    sim_queue_status_report(mcu, sequence, info->last_byte);
+  }
+}
+
+static void sim_write(struct sim_mcu *mcu, const uint8_t *data, size_t length)
+{
+  while (length > 0) {
+    ssize_t written = write(mcu->fd, data, length);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    } else if (written < 0) {
+      // Nobody is reading the other side, data is lost like on a real line.
+      return;
+    }
+
+    data += written;
+    length -= written;
+  }
+}
+
+static void sim_inject_noise(struct sim_mcu *mcu, size_t length)
+{
+  uint8_t noise[SIM_NOISE_BURST];
+  while (length > 0) {
+    size_t chunk = length < sizeof(noise) ? length : sizeof(noise);
+    for (size_t i = 0; i < chunk; i++) {
+      noise[i] = sim_random(mcu);
+    }
+
+    sim_write(mcu, noise, chunk);
+    mcu->noise_bytes += chunk;
+    length -= chunk;
+  }
+}
+
+static uint64_t sim_process(struct sim_mcu *mcu, uint64_t now)
+{
+  uint64_t next = now + SIM_TICK * SIM_MS;
+
+  // Write replies whose latency has passed.
+  while (mcu->reply_count > 0) {
+    struct sim_reply *reply = &mcu->replies[mcu->reply_head];
+    if (reply->due > now) {
+      if (reply->due < next) {
+        next = reply->due;
+      }
+      break;
+    }
+
+    sim_write(mcu, reply->frame, reply->length);
+    mcu->reply_head = (mcu->reply_head + 1) % SIM_REPLY_QUEUE_SIZE;
+    mcu->reply_count--;
+    mcu->replies_sent++;
+  }
+
+  // Streamed status reports.
+  if (mcu->stream_interval && now <= mcu->stream_expires) {
+    if (now >= mcu->stream_next) {
+      sim_queue_status_report(mcu, NULL, now);
+      mcu->stream_next += mcu->stream_interval * SIM_MS;
+      if (mcu->stream_next < now) {
+        mcu->stream_next = now + mcu->stream_interval * SIM_MS;
+      }
+    }
+
+    if (mcu->stream_next < next) {
+      next = mcu->stream_next;
+    }
+  }
+
+  // Background line noise, a byte at a time.
+  if (mcu->noise_rate > 0) {
+    while (now >= mcu->next_noise) {
+      sim_inject_noise(mcu, 1);
+      mcu->next_noise += (uint64_t) (1e9 / mcu->noise_rate);
+    }
+
+    if (mcu->next_noise < next) {
+      next = mcu->next_noise;
+    }
+  }
+
+  if (sim_noise_requested) {
+    sim_noise_requested = 0;
+    sim_inject_noise(mcu, SIM_NOISE_BURST);
+  }
+
+  return next;
+}
+
+static void sim_usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-a] [-L] [-l link] [-d latency_ms] [-v speed] [-n noise_rate] [-s seed]\n", name);
+  fprintf(stderr, "  -a  simulate the accelerometer instead of the motor driver\n");
+  fprintf(stderr, "  -L  simulate legacy firmware (no sequence numbers or streaming)\n");
+  fprintf(stderr, "  -l  create a symlink to the simulated serial device\n");
+  fprintf(stderr, "  -d  reply latency in milliseconds (default 2)\n");
+  fprintf(stderr, "  -v  motor speed in steps per second (default 1000)\n");
+  fprintf(stderr, "  -n  line noise in bytes per second (default 0)\n");
+  fprintf(stderr, "Send SIGUSR1 to inject a burst of line noise.\n");
+}
+
+int main(int argc, char **argv)
+{
+  static struct sim_mcu mcu;
+  const char *link = NULL;
+  int c;
+
+  mcu.latency = 2 * SIM_MS;
+  mcu.speed = 1000;
+  mcu.random = 1;
+
+  while ((c = getopt(argc, argv, "aLl:d:v:n:s:h")) != -1) {
+    switch (c) {
+      case 'a': mcu.accelerometer = 1; break;
+      case 'L': mcu.legacy = 1; break;
+      case 'l': link = optarg; break;
+      case 'd': mcu.latency = atof(optarg) * SIM_MS; break;
+      case 'v': mcu.speed = atof(optarg); break;
+      case 'n': mcu.noise_rate = atof(optarg); break;
+      case 's': mcu.random = strtoul(optarg, NULL, 0) | 1; break;
+      default: sim_usage(argv[0]); return 1;
+    }
+  }
+
+  mcu.fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (mcu.fd < 0 || grantpt(mcu.fd) != 0 || unlockpt(mcu.fd) != 0) {
+    fprintf(stderr, "Failed to create pseudo-terminal: %s\n", strerror(errno));
+    return 1;
+  }
+
+  // The simulated line is raw, like the MCU UART.
+  struct termios tio;
+  if (tcgetattr(mcu.fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    tcsetattr(mcu.fd, TCSANOW, &tio);
+  }
+
+  const char *device = ptsname(mcu.fd);
+  if (link) {
+    unlink(link);
+    if (symlink(device, link) != 0) {
+      fprintf(stderr, "Failed to create link '%s': %s\n", link, strerror(errno));
+      return 1;
+    }
+    device = link;
+  }
+
+  printf("%s\n", device);
+  fflush(stdout);
+
+  signal(SIGUSR1, sim_signal_handler);
+  signal(SIGINT, sim_signal_handler);
+  signal(SIGTERM, sim_signal_handler);
+
+  frame_parser_init_fixed(&mcu.parser, SIM_REPLY_MAX_SIZE);
+  mcu.parser.handler = sim_message_handler;
+  mcu.parser.context = &mcu;
+  mcu.last_update = frame_timestamp_now();
+  mcu.next_noise = mcu.last_update;
+
+  while (!sim_exit_requested) {
+    uint64_t now = frame_timestamp_now();
+    uint64_t next = sim_process(&mcu, now);
+
+    struct pollfd pfd = { .fd = mcu.fd, .events = POLLIN };
+    now = frame_timestamp_now();
+    int timeout = next > now ? (int) ((next - now + SIM_MS - 1) / SIM_MS) : 0;
+    if (poll(&pfd, 1, timeout) <= 0) {
+      continue;
+    }
+
+    // Until the daemon opens the other side, the master reports a hangup.
+    if (!(pfd.revents & POLLIN)) {
+      usleep(SIM_TICK * 1000);
+      continue;
+    }
+
+    uint8_t buffer[1024];
+    ssize_t size = read(mcu.fd, buffer, sizeof(buffer));
+    if (size > 0) {
+      frame_parser_push_buffer_at(&mcu.parser, buffer, size, frame_timestamp_now());
+    }
+  }
+
+  fprintf(stderr, "requests=%llu replies=%llu noise_bytes=%llu parse_errors=%llu checksum_errors=%llu\n",
+    (unsigned long long) mcu.requests, (unsigned long long) mcu.replies_sent,
+    (unsigned long long) mcu.noise_bytes, (unsigned long long) mcu.parser.statistics.parse_errors,
+    (unsigned long long) mcu.parser.statistics.checksum_errors);
+
+  if (link) {
+    unlink(link);
+  }
+  frame_parser_free(&mcu.parser);
+  close(mcu.fd);
+  return 0;
+}
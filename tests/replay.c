@@ -0,0 +1,216 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "capture.h"
+#include "frame.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Number of device identifiers in capture records.
+#define REPLAY_MAX_DEVICES 256
+// Default maximum length of received frames, as used by the driver.
+#define REPLAY_MAX_FRAME_LENGTH 1024
+
+/**
+ * Replay state of one direction of a device.
+ */
+struct replay_stream {
+  int initialized;
+  parser_t parser;
+  // Number of decoded status and error reports.
+  uint64_t status_reports;
+  uint64_t error_reports;
+  uint64_t commands;
+  // Time spent parsing and decoding (in nanoseconds).
+  uint64_t parse_time;
+};
+
+static struct replay_stream replay_streams[REPLAY_MAX_DEVICES][2];
+static char *replay_names[REPLAY_MAX_DEVICES];
+static int replay_print;
+
+static void replay_message_handler(const message_t *message, const frame_info_t *info)
+{
+  struct replay_stream *stream = (struct replay_stream*) info->context;
+
+  // Decode like the driver does, so replays measure the whole receive path.
+  message_report_t report;
+  if (message_decode(message, &report) != MESSAGE_SUCCESS) {
+    return;
+  }
+
+  if (MESSAGE_REPORT_HAS(&report, REPLY)) {
+    if (report.reply == REPLY_STATUS_REPORT) {
+      stream->status_reports++;
+    } else if (report.reply == REPLY_ERROR_REPORT) {
+      stream->error_reports++;
+    }
+  }
+  if (MESSAGE_REPORT_HAS(&report, COMMAND)) {
+    stream->commands++;
+  }
+
+  if (replay_print) {
+    printf("[%llu.%06llu] ", (unsigned long long) (info->last_byte / 1000000000ULL),
+      (unsigned long long) (info->last_byte % 1000000000ULL) / 1000);
+    message_print(message);
+    printf("\n");
+  }
+}
+
+static void replay_sleep_until(uint64_t deadline)
+{
+  struct timespec ts;
+  ts.tv_sec = deadline / 1000000000ULL;
+  ts.tv_nsec = deadline % 1000000000ULL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+  }
+}
+
+static void replay_report(int device, capture_type_t type, const struct replay_stream *stream)
+{
+  const frame_parser_statistics_t *statistics = &stream->parser.statistics;
+  char name[16];
+  if (!replay_names[device]) {
+    snprintf(name, sizeof(name), "%d", device);
+  }
+
+  printf("{\"device\":\"%s\",\"direction\":\"%s\",\"bytes\":%llu,\"frames\":%llu,\"tlvs\":%llu,"
+    "\"status_reports\":%llu,\"error_reports\":%llu,\"commands\":%llu,"
+    "\"resyncs\":%llu,\"oversized\":%llu,\"parse_errors\":%llu,\"checksum_errors\":%llu,"
+    "\"ns_per_byte\":%.3f}\n",
+    replay_names[device] ? replay_names[device] : name, type == CAPTURE_RX ? "rx" : "tx",
+    (unsigned long long) statistics->bytes, (unsigned long long) statistics->frames,
+    (unsigned long long) statistics->tlvs, (unsigned long long) stream->status_reports,
+    (unsigned long long) stream->error_reports, (unsigned long long) stream->commands,
+    (unsigned long long) statistics->resyncs, (unsigned long long) statistics->oversized,
+    (unsigned long long) statistics->parse_errors, (unsigned long long) statistics->checksum_errors,
+    statistics->bytes ? (double) stream->parse_time / statistics->bytes : 0);
+}
+
+static void replay_usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-r] [-t] [-p] [-d device] [-m max_frame_length] capture\n", name);
+  fprintf(stderr, "  -r  replay at the original speed instead of as fast as possible\n");
+  fprintf(stderr, "  -t  also parse transmitted data\n");
+  fprintf(stderr, "  -p  print decoded messages\n");
+  fprintf(stderr, "  -d  only replay the given device (name or identifier)\n");
+}
+
+int main(int argc, char **argv)
+{
+  static capture_reader_t reader;
+  int realtime = 0;
+  int transmitted = 0;
+  const char *only = NULL;
+  size_t max_frame_length = REPLAY_MAX_FRAME_LENGTH;
+  int c;
+
+  while ((c = getopt(argc, argv, "rtpd:m:h")) != -1) {
+    switch (c) {
+      case 'r': realtime = 1; break;
+      case 't': transmitted = 1; break;
+      case 'p': replay_print = 1; break;
+      case 'd': only = optarg; break;
+      case 'm': max_frame_length = strtoul(optarg, NULL, 0); break;
+      default: replay_usage(argv[0]); return 1;
+    }
+  }
+
+  if (optind >= argc) {
+    replay_usage(argv[0]);
+    return 1;
+  }
+
+  if (capture_reader_open(&reader, argv[optind]) != 0) {
+    fprintf(stderr, "Failed to open capture '%s'.\n", argv[optind]);
+    return 1;
+  }
+
+  capture_record_t record;
+  uint64_t first_record = 0;
+  uint64_t start = frame_timestamp_now();
+  int result;
+
+  while ((result = capture_read(&reader, &record)) > 0) {
+    if (record.type == CAPTURE_SESSION) {
+      // Timestamps of a new session are not related to the previous one.
+      first_record = 0;
+      start = frame_timestamp_now();
+      continue;
+    } else if (record.type == CAPTURE_DEVICE_NAME) {
+      free(replay_names[record.device]);
+      replay_names[record.device] = strndup((const char*) record.data, record.length);
+      continue;
+    } else if (record.type != CAPTURE_RX && (record.type != CAPTURE_TX || !transmitted)) {
+      continue;
+    }
+
+    if (only) {
+      char id[8];
+      snprintf(id, sizeof(id), "%d", record.device);
+      if (strcmp(only, id) != 0 && (!replay_names[record.device] || strcmp(only, replay_names[record.device]) != 0)) {
+        continue;
+      }
+    }
+
+    if (!first_record) {
+      first_record = record.timestamp;
+    }
+
+    if (realtime && record.timestamp > first_record) {
+      replay_sleep_until(start + (record.timestamp - first_record));
+    }
+
+    struct replay_stream *stream = &replay_streams[record.device][record.type];
+    if (!stream->initialized) {
+      frame_parser_init_fixed(&stream->parser, max_frame_length);
+      stream->parser.handler = replay_message_handler;
+      stream->parser.context = stream;
+      stream->initialized = 1;
+    }
+
+    // Frames keep their original timestamps.
+    uint64_t parse_start = frame_timestamp_now();
+    frame_parser_push_buffer_at(&stream->parser, (uint8_t*) record.data, record.length, record.timestamp);
+    stream->parse_time += frame_timestamp_now() - parse_start;
+  }
+
+  if (result < 0) {
+    fprintf(stderr, "Capture is truncated or corrupted, stopping.\n");
+  }
+
+  for (int device = 0; device < REPLAY_MAX_DEVICES; device++) {
+    for (int type = CAPTURE_RX; type <= CAPTURE_TX; type++) {
+      struct replay_stream *stream = &replay_streams[device][type];
+      if (!stream->initialized) {
+        continue;
+      }
+
+      replay_report(device, type, stream);
+      frame_parser_free(&stream->parser);
+    }
+  }
+
+  capture_reader_close(&reader);
+  return result < 0 ? 1 : 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "capture.h"
+#include "frame.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int number_counted_messages = 0;
+
+static void count_message_handler(const message_t *message, const frame_info_t *info)
+{
+  number_counted_messages++;
+}
+
+int main()
+{
+  static capture_reader_t reader;
+  char path[] = "/tmp/test_capture_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    printf("Failed to create temporary file.\n");
+    return -1;
+  }
+  close(fd);
+
+  message_t msg;
+  message_init(&msg);
+  message_tlv_add_reply(&msg, REPLY_STATUS_REPORT);
+  tlv_motor_position_t position = {1, -2, 3};
+  message_tlv_add_motor_position(&msg, &position);
+  uint8_t frame[128];
+  ssize_t frame_size = frame_message_checksum(frame, sizeof(frame), &msg);
+  message_free(&msg);
+
+  // Capture a frame received in two chunks and a large transmitted buffer,
+  // reopening the file in between.
+  capture_t capture;
+  if (capture_open(&capture, path) != 0) {
+    printf("Failed to open capture.\n");
+    return -1;
+  }
+  capture_write(&capture, 1, CAPTURE_DEVICE_NAME, 10, (const uint8_t*) "motors", 6);
+  capture_write(&capture, 1, CAPTURE_RX, 100, frame, frame_size / 2);
+  capture_close(&capture);
+
+  uint8_t *large = (uint8_t*) calloc(1, CAPTURE_MAX_RECORD_LENGTH + 10);
+  if (capture_open(&capture, path) != 0 ||
+      capture_write(&capture, 1, CAPTURE_RX, 200, frame + frame_size / 2, frame_size - frame_size / 2) != 0 ||
+      capture_write(&capture, 2, CAPTURE_TX, 300, large, CAPTURE_MAX_RECORD_LENGTH + 10) != 0) {
+    printf("Failed to append to capture.\n");
+    return -1;
+  }
+  if (capture.records != 4) {
+    printf("Large record was not split.\n");
+    return -1;
+  }
+  capture_close(&capture);
+  free(large);
+
+  if (capture_reader_open(&reader, path) != 0) {
+    printf("Failed to open capture for reading.\n");
+    return -1;
+  }
+
+  parser_t parser;
+  frame_parser_init(&parser);
+  parser.handler = count_message_handler;
+
+  const struct {
+    uint64_t timestamp;
+    uint8_t device;
+    capture_type_t type;
+    uint16_t length;
+  } expected[] = {
+    {0, 0, CAPTURE_SESSION, 0},
+    {10, 1, CAPTURE_DEVICE_NAME, 6},
+    {100, 1, CAPTURE_RX, frame_size / 2},
+    {0, 0, CAPTURE_SESSION, 0},
+    {200, 1, CAPTURE_RX, frame_size - frame_size / 2},
+    {300, 2, CAPTURE_TX, CAPTURE_MAX_RECORD_LENGTH},
+    {300, 2, CAPTURE_TX, 10},
+  };
+
+  capture_record_t record;
+  size_t records = 0;
+  int result;
+  while ((result = capture_read(&reader, &record)) > 0) {
+    if (records >= sizeof(expected) / sizeof(expected[0]) ||
+        (record.type != CAPTURE_SESSION && record.timestamp != expected[records].timestamp) ||
+        record.device != expected[records].device ||
+        record.type != expected[records].type || record.length != expected[records].length) {
+      printf("Capture record %zu does not match.\n", records);
+      return -1;
+    }
+
+    if (record.type == CAPTURE_RX) {
+      frame_parser_push_buffer_at(&parser, (uint8_t*) record.data, record.length, record.timestamp);
+    }
+    records++;
+  }
+
+  if (result != 0 || records != sizeof(expected) / sizeof(expected[0])) {
+    printf("Failed to read all capture records.\n");
+    return -1;
+  }
+
+  if (number_counted_messages != 1) {
+    printf("Replayed capture did not produce the captured frame.\n");
+    return -1;
+  }
+
+  frame_parser_free(&parser);
+  capture_reader_close(&reader);
+
+  // Truncated records are reported. The file is cut within the device name
+  // record, which follows the first session record.
+  if (truncate(path, CAPTURE_MAGIC_LENGTH + 2 * CAPTURE_RECORD_HEADER_SIZE + 2) != 0 ||
+      capture_reader_open(&reader, path) != 0) {
+    printf("Failed to truncate capture.\n");
+    return -1;
+  }
+  if (capture_read(&reader, &record) != 1 || capture_read(&reader, &record) != -1) {
+    printf("Truncated capture record was not detected.\n");
+    return -1;
+  }
+  capture_reader_close(&reader);
+
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "crc32.h"
+
+#include <stdio.h>
+
+int main()
+{
+  const char *check = "123456789";
+  uint8_t buffer[4096];
+  for (size_t i = 0; i < sizeof(buffer); i++) {
+    buffer[i] = (uint8_t) (i * 31 + (i >> 7));
+  }
+
+  if (crc32_set_backend(CRC32_BACKEND_BYTEWISE) != 0) {
+    printf("Reference CRC32 implementation is not available.\n");
+    return -1;
+  }
+  uint32_t reference = crc32(0, buffer, sizeof(buffer));
+
+  for (crc32_backend_t backend = CRC32_BACKEND_BYTEWISE; backend < __CRC32_BACKEND_MAX; backend++) {
+    if (crc32_set_backend(backend) != 0) {
+      printf("CRC32 implementation '%s' is not supported.\n", crc32_backend_name(backend));
+      continue;
+    }
+
+    printf("Testing CRC32 implementation '%s'.\n", crc32_backend_name(backend));
+
+    if (crc32(0, check, 9) != 0xCBF43926) {
+      printf("Invalid CRC32 of check string.\n");
+      return -1;
+    }
+
+    if (crc32(0, buffer, sizeof(buffer)) != reference ||
+        crc32(crc32(0, buffer, 1000), buffer + 1000, sizeof(buffer) - 1000) != reference) {
+      printf("CRC32 differs from the reference implementation.\n");
+      return -1;
+    }
+  }
+
+  crc32_backend_t selected = crc32_init();
+  printf("Selected CRC32 implementation '%s'.\n", crc32_backend_name(selected));
+  if (selected == CRC32_BACKEND_AUTO || crc32(0, check, 9) != 0xCBF43926) {
+    printf("Failed to select a CRC32 implementation.\n");
+    return -1;
+  }
+
+  return 0;
+}
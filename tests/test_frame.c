@@ -20,10 +20,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 static size_t number_parsed_messages = 0;
 
-static void validate_message_handler(const message_t *message)
+static void validate_message_handler(const message_t *message, const frame_info_t *info)
 {
   printf("Received message from frame parser.\n");
 
@@ -55,6 +56,74 @@ static void validate_message_handler(const message_t *message)
   number_parsed_messages++;
 }
 
+static size_t number_counted_messages = 0;
+
+static void count_message_handler(const message_t *message, const frame_info_t *info)
+{
+  number_counted_messages++;
+}
+
+static frame_info_t last_frame_info;
+
+static void record_info_message_handler(const message_t *message, const frame_info_t *info)
+{
+  last_frame_info = *info;
+  number_counted_messages++;
+}
+
+/**
+ * Feeds the same stream to a parser in chunks through the bulk path and to
+ * another parser byte by byte, checking that both end up in the same state.
+ */
+static int compare_parsers(uint8_t *stream, size_t length, uint32_t seed, size_t max_chunk)
+{
+  parser_t bulk, bytewise;
+  frame_parser_init(&bulk);
+  frame_parser_init(&bytewise);
+  bulk.handler = count_message_handler;
+  bytewise.handler = count_message_handler;
+
+  size_t bulk_messages = 0;
+  size_t bytewise_messages = 0;
+  int result = 0;
+  for (size_t offset = 0; offset < length;) {
+    seed = seed * 1103515245 + 12345;
+    size_t chunk = 1 + (seed >> 8) % max_chunk;
+    if (chunk > length - offset) {
+      chunk = length - offset;
+    }
+
+    number_counted_messages = 0;
+    frame_parser_push_buffer(&bulk, stream + offset, chunk);
+    bulk_messages += number_counted_messages;
+
+    number_counted_messages = 0;
+    for (size_t i = 0; i < chunk; i++) {
+      frame_parser_push_byte(&bytewise, stream[offset + i]);
+    }
+    bytewise_messages += number_counted_messages;
+
+    offset += chunk;
+    if (bulk.state != bytewise.state ||
+        bulk.length != bytewise.length ||
+        memcmp(bulk.buffer, bytewise.buffer, bulk.length) != 0 ||
+        bulk_messages != bytewise_messages ||
+        bulk.statistics.bytes != bytewise.statistics.bytes ||
+        bulk.statistics.frames != bytewise.statistics.frames ||
+        bulk.statistics.resyncs != bytewise.statistics.resyncs ||
+        bulk.statistics.oversized != bytewise.statistics.oversized ||
+        bulk.statistics.parse_errors != bytewise.statistics.parse_errors) {
+      printf("Bulk parser diverged at offset %zu.\n", offset);
+      result = -1;
+      break;
+    }
+  }
+
+  frame_parser_free(&bulk);
+  frame_parser_free(&bytewise);
+  return result;
+}
+
 int main()
 {
   message_t msg;
@@ -97,6 +166,204 @@ int main()
     return -1;
   }
 
+  // Framing with an inline checksum must produce an identical frame.
+  message_t msg_no_checksum;
+  message_init(&msg_no_checksum);
+  message_tlv_add_command(&msg_no_checksum, COMMAND_RESTORE_MOTOR);
+  message_tlv_add_motor_position(&msg_no_checksum, &position);
+
+  uint8_t frame_checksum[1024];
+  ssize_t frame_checksum_size = frame_message_checksum(frame_checksum, sizeof(frame_checksum), &msg_no_checksum);
+  if (frame_checksum_size != frame_size || memcmp(frame, frame_checksum, frame_size) != 0) {
+    printf("Frame with inline checksum differs.\n");
+    return -1;
+  }
+  message_free(&msg_no_checksum);
+
+  // A message consisting only of escaped bytes must exactly fill the worst-case size.
+  size_t markers_length = (FRAME_MARKER_ESCAPE << 8) | FRAME_MARKER_ESCAPE;
+  uint8_t *markers = (uint8_t*) malloc(markers_length);
+  memset(markers, FRAME_MARKER_ESCAPE, markers_length);
+  message_t msg_markers;
+  message_init(&msg_markers);
+  message_tlv_add(&msg_markers, FRAME_MARKER_END, markers_length, markers);
+  size_t max_size = frame_message_max_size(&msg_markers);
+  uint8_t *frame_markers = (uint8_t*) malloc(max_size);
+  if (frame_message(frame_markers, max_size, &msg_markers) != max_size ||
+      frame_message(frame_markers, max_size - 1, &msg_markers) != -1) {
+    printf("Worst-case frame size is not exact.\n");
+    return -1;
+  }
+  free(frame_markers);
+  free(markers);
+  message_free(&msg_markers);
+
+  // Patched frame templates must match freshly framed messages.
+  message_t msg_status;
+  message_init(&msg_status);
+  message_tlv_add_command(&msg_status, COMMAND_GET_STATUS);
+  message_tlv_add_power_reading(&msg_status, 0);
+  message_tlv_add_motor_position(&msg_status, &position);
+
+  frame_template_t template;
+  if (frame_template_init(&template, &msg_status, TLV_POWER_READING) != 0) {
+    printf("Failed to prepare frame template.\n");
+    return -1;
+  }
+
+  const uint16_t powers[] = {0, 1234, 0xF1F2, 0xF3F3, 0x00F2};
+  for (size_t i = 0; i < sizeof(powers) / sizeof(powers[0]); i++) {
+    uint8_t power[2] = {powers[i] >> 8, powers[i] & 0xFF};
+    if (frame_template_patch(&template, power, sizeof(power)) != 0) {
+      printf("Failed to patch frame template.\n");
+      return -1;
+    }
+
+    message_free(&msg_status);
+    message_tlv_add_command(&msg_status, COMMAND_GET_STATUS);
+    message_tlv_add_power_reading(&msg_status, powers[i]);
+    message_tlv_add_motor_position(&msg_status, &position);
+    frame_size = frame_message_checksum(frame, sizeof(frame), &msg_status);
+    if (frame_size != template.frame_length || memcmp(frame, template.frame, frame_size) != 0) {
+      printf("Patched frame template differs for power %u.\n", powers[i]);
+      return -1;
+    }
+  }
+
+  // TLVs following the variable one can be patched as well, preceding ones can not.
+  uint8_t position_value[12] = {0xF1, 0xF2, 0xF3, 0, 0, 0, 1, 0, 0, 0, 0, 2};
+  uint8_t command_value[1] = {COMMAND_HOMING};
+  if (frame_template_patch_tlv(&template, TLV_MOTOR_POSITION, position_value, sizeof(position_value)) != 0 ||
+      frame_template_patch_tlv(&template, TLV_COMMAND, command_value, sizeof(command_value)) != -1 ||
+      frame_template_patch_tlv(&template, TLV_MOTOR_POSITION, position_value, 4) != -1) {
+    printf("Failed to patch frame template TLV.\n");
+    return -1;
+  }
+
+  tlv_motor_position_t patched_position = {(int32_t) 0xF1F2F300, 0x100, 2};
+  message_free(&msg_status);
+  message_tlv_add_command(&msg_status, COMMAND_GET_STATUS);
+  message_tlv_add_power_reading(&msg_status, powers[sizeof(powers) / sizeof(powers[0]) - 1]);
+  message_tlv_add_motor_position(&msg_status, &patched_position);
+  frame_size = frame_message_checksum(frame, sizeof(frame), &msg_status);
+  if (frame_size != template.frame_length || memcmp(frame, template.frame, frame_size) != 0) {
+    printf("Patched frame template TLV differs.\n");
+    return -1;
+  }
+  message_free(&msg_status);
+
+  // The bulk parser path must behave exactly like pushing single bytes, for
+  // random line noise with many markers as well as for valid frames.
+  size_t stream_length = 3 * FRAME_MAX_LENGTH;
+  uint8_t *stream = (uint8_t*) malloc(stream_length);
+  uint32_t seed = 1;
+  size_t offset = 0;
+  while (offset + 1024 < stream_length) {
+    seed = seed * 1103515245 + 12345;
+    if ((seed >> 16) % 4 == 0) {
+      frame_size = frame_message(stream + offset, stream_length - offset, &msg);
+      offset += frame_size;
+    } else {
+      size_t noise = (seed >> 8) % 64;
+      for (size_t i = 0; i < noise; i++) {
+        seed = seed * 1103515245 + 12345;
+        stream[offset++] = (seed >> 16) % 3 == 0 ? FRAME_MARKER_START + (seed >> 20) % 3 : seed >> 16;
+      }
+    }
+  }
+  if (compare_parsers(stream, offset, 7, 300) != 0) {
+    return -1;
+  }
+
+  // Oversized frames, right at and beyond the maximum frame length.
+  const size_t oversize[] = {FRAME_MAX_LENGTH, FRAME_MAX_LENGTH + 1, FRAME_MAX_LENGTH + 2};
+  for (size_t i = 0; i < sizeof(oversize) / sizeof(oversize[0]); i++) {
+    memset(stream, 0x42, stream_length);
+    stream[0] = FRAME_MARKER_START;
+    stream[1 + oversize[i]] = FRAME_MARKER_END;
+    frame_size = frame_message(stream + oversize[i] + 2, stream_length - oversize[i] - 2, &msg);
+    if (compare_parsers(stream, oversize[i] + 2 + frame_size, 11, 300) != 0 ||
+        compare_parsers(stream, oversize[i] + 2 + frame_size, 11, 2) != 0) {
+      return -1;
+    }
+
+    stream[1 + oversize[i]] = 0x42;
+    if (compare_parsers(stream, oversize[i] + 2 + frame_size, 13, 300) != 0 ||
+        compare_parsers(stream, oversize[i] + 2 + frame_size, 13, 2) != 0) {
+      return -1;
+    }
+  }
+  free(stream);
+
+  // A fixed parser discards oversized frames without growing its buffer.
+  frame_size = frame_message(frame, sizeof(frame), &msg);
+  parser_t fixed;
+  frame_parser_init_fixed(&fixed, frame_size);
+  fixed.handler = count_message_handler;
+  uint8_t *fixed_buffer = fixed.buffer;
+  uint8_t oversized[2048];
+  memset(oversized, 0x42, sizeof(oversized));
+  oversized[0] = FRAME_MARKER_START;
+  oversized[sizeof(oversized) - 1] = FRAME_MARKER_END;
+
+  number_counted_messages = 0;
+  frame_parser_push_buffer(&fixed, oversized, sizeof(oversized));
+  frame_parser_push_buffer(&fixed, frame, frame_size);
+  for (size_t i = 0; i < sizeof(oversized); i++) {
+    frame_parser_push_byte(&fixed, oversized[i]);
+  }
+  frame_parser_push_buffer(&fixed, frame, frame_size);
+  if (number_counted_messages != 2 || fixed.buffer != fixed_buffer || fixed.buffer_size != frame_size) {
+    printf("Fixed parser did not discard oversized frames.\n");
+    return -1;
+  }
+  frame_parser_free(&fixed);
+
+  // Frames carry the timestamps of the buffers with their first and last byte,
+  // where a resync restarts the frame, and the parser context.
+  const uint8_t partial[] = {FRAME_MARKER_START, 0x42};
+  frame_parser_init_fixed(&fixed, 256);
+  fixed.handler = record_info_message_handler;
+  fixed.context = &fixed;
+  number_counted_messages = 0;
+  frame_parser_push_buffer_at(&fixed, (uint8_t*) partial, sizeof(partial), 50);
+  frame_parser_push_buffer_at(&fixed, frame, frame_size / 2, 100);
+  frame_parser_push_buffer_at(&fixed, frame + frame_size / 2, frame_size - frame_size / 2, 200);
+  if (number_counted_messages != 1 || last_frame_info.first_byte != 100 || last_frame_info.last_byte != 200 ||
+      last_frame_info.context != &fixed) {
+    printf("Frame metadata is invalid.\n");
+    return -1;
+  }
+  frame_parser_free(&fixed);
+
+  // Statistics account for every discarded frame.
+  message_t msg_bad_checksum;
+  uint8_t bad_checksum[4] = {0x12, 0x34, 0x56, 0x78};
+  message_init(&msg_bad_checksum);
+  message_tlv_add_command(&msg_bad_checksum, COMMAND_GET_STATUS);
+  message_tlv_add(&msg_bad_checksum, TLV_CHECKSUM, sizeof(bad_checksum), bad_checksum);
+  uint8_t frame_bad_checksum[64];
+  ssize_t frame_bad_checksum_size = frame_message(frame_bad_checksum, sizeof(frame_bad_checksum), &msg_bad_checksum);
+  message_free(&msg_bad_checksum);
+
+  const uint8_t junk[] = {FRAME_MARKER_START, 0x42, 0x42, FRAME_MARKER_END, FRAME_MARKER_START, 0x01};
+  frame_parser_init_fixed(&fixed, 256);
+  frame_parser_push_buffer(&fixed, (uint8_t*) junk, sizeof(junk));
+  frame_parser_push_buffer(&fixed, frame, frame_size);
+  frame_parser_push_buffer(&fixed, frame_bad_checksum, frame_bad_checksum_size);
+  frame_parser_push_buffer(&fixed, oversized, sizeof(oversized));
+  if (fixed.statistics.bytes != sizeof(junk) + frame_size + frame_bad_checksum_size + sizeof(oversized) ||
+      fixed.statistics.frames != 1 ||
+      fixed.statistics.tlvs != 3 ||
+      fixed.statistics.resyncs != 1 ||
+      fixed.statistics.parse_errors != 1 ||
+      fixed.statistics.checksum_errors != 1 ||
+      fixed.statistics.oversized != 1) {
+    printf("Parser statistics are invalid.\n");
+    return -1;
+  }
+  frame_parser_free(&fixed);
+
   message_free(&msg);
 
   return 0;
@@ -0,0 +1,208 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "request.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static size_t number_sent_frames = 0;
+static int send_result = 0;
+static message_t last_sent_message;
+
+static int record_send_handler(void *context, const uint8_t *frame, size_t length)
+{
+  if (send_result != 0) {
+    return send_result;
+  }
+
+  // Strip frame markers, test frames contain no bytes that need escaping.
+  message_free(&last_sent_message);
+  if (message_parse(&last_sent_message, frame + 1, length - 2) != MESSAGE_SUCCESS) {
+    printf("Failed to parse sent frame.\n");
+    return -1;
+  }
+
+  number_sent_frames++;
+  return 0;
+}
+
+static message_report_t make_reply(int with_sequence, uint16_t sequence)
+{
+  message_t msg;
+  message_report_t report;
+
+  message_init(&msg);
+  message_tlv_add_reply(&msg, REPLY_STATUS_REPORT);
+  if (with_sequence) {
+    message_tlv_add_sequence(&msg, sequence);
+  }
+  message_decode(&msg, &report);
+  message_free(&msg);
+
+  return report;
+}
+
+static int submit_command(request_tracker_t *tracker, tlv_command_t command, uint8_t retries, uint64_t timestamp)
+{
+  message_t msg;
+  message_init(&msg);
+  message_tlv_add_command(&msg, command);
+  int result = request_tracker_submit(tracker, &msg, command, retries, timestamp);
+  message_free(&msg);
+  return result;
+}
+
+int main()
+{
+  request_tracker_t tracker;
+  message_init(&last_sent_message);
+  request_tracker_init(&tracker, record_send_handler, NULL, 2, 1000000);
+
+  // Without sequence number support, only status requests wait for a reply.
+  submit_command(&tracker, COMMAND_MOVE_MOTOR, 0, 1000);
+  submit_command(&tracker, COMMAND_GET_STATUS, 0, 2000);
+  submit_command(&tracker, COMMAND_GET_STATUS, 0, 3000);
+  submit_command(&tracker, COMMAND_GET_STATUS, 0, 4000);
+  if (number_sent_frames != 3 ||
+      request_tracker_count(&tracker, REQUEST_IN_FLIGHT) != 2 ||
+      request_tracker_count(&tracker, REQUEST_PENDING) != 1) {
+    printf("Command window is not respected.\n");
+    return -1;
+  }
+
+  // Replies without sequence numbers are matched to status requests in order,
+  // which opens the window for the pending request.
+  message_report_t reply = make_reply(0, 0);
+  request_t request;
+  if (request_tracker_complete(&tracker, &reply, 2000 + 5000000, &request) != 0 ||
+      request.command != COMMAND_GET_STATUS || request.timestamp != 2000 ||
+      number_sent_frames != 4 || request_tracker_count(&tracker, REQUEST_PENDING) != 0) {
+    printf("Failed to match reply without sequence number.\n");
+    return -1;
+  }
+
+  // Requests time out and are expired once out of retries.
+  if (request_tracker_next_deadline(&tracker) != 3000 + 1000000 ||
+      request_tracker_poll(&tracker, 10000000) != 2 ||
+      request_tracker_count(&tracker, REQUEST_IN_FLIGHT) != 0) {
+    printf("Failed to expire requests.\n");
+    return -1;
+  }
+
+  // Requests include a sequence number, which replies are matched by exactly.
+  submit_command(&tracker, COMMAND_HOMING, 1, 20000000);
+  uint16_t sequence;
+  if (message_tlv_get_sequence(&last_sent_message, &sequence) != MESSAGE_SUCCESS) {
+    printf("Request does not include a sequence number.\n");
+    return -1;
+  }
+
+  reply = make_reply(1, sequence);
+  if (request_tracker_complete(&tracker, &reply, 20000000 + 300000, &request) == 0) {
+    printf("Matched a reply to a command that was not waiting for one.\n");
+    return -1;
+  }
+
+  // Once supported, all commands wait for a reply and are retried on timeout.
+  size_t sent = number_sent_frames;
+  submit_command(&tracker, COMMAND_HOMING, 1, 30000000);
+  message_tlv_get_sequence(&last_sent_message, &sequence);
+  if (request_tracker_poll(&tracker, 31000000) != 0 || tracker.retried != 1 || number_sent_frames != sent + 2) {
+    printf("Failed to retry a timed out command.\n");
+    return -1;
+  }
+
+  reply = make_reply(1, sequence);
+  if (request_tracker_complete(&tracker, &reply, 31000000 + 300000, &request) != 0 ||
+      request.command != COMMAND_HOMING) {
+    printf("Failed to match reply with sequence number.\n");
+    return -1;
+  }
+
+  // A sequence number that is not in flight is not matched.
+  if (request_tracker_complete(&tracker, &reply, 32000000, NULL) == 0) {
+    printf("Matched a reply to a completed request.\n");
+    return -1;
+  }
+
+  // Round-trip times land in logarithmic buckets.
+  const request_histogram_t *status = request_tracker_histogram(&tracker, COMMAND_GET_STATUS);
+  const request_histogram_t *homing = request_tracker_histogram(&tracker, COMMAND_HOMING);
+  if (status->count != 1 || status->min != 5000 || status->buckets[request_histogram_bucket(5000)] != 1 ||
+      homing->count != 1 || homing->max != 300 || homing->buckets[9] != 1) {
+    printf("Round-trip time histograms are invalid.\n");
+    return -1;
+  }
+
+  if (request_histogram_bucket(0) != 0 || request_histogram_bucket(1) != 1 ||
+      request_histogram_bucket(1023) != 10 || request_histogram_bucket(1024) != 11 ||
+      request_histogram_bucket(~0ULL) != REQUEST_HISTOGRAM_BUCKETS - 1) {
+    printf("Histogram bucket boundaries are invalid.\n");
+    return -1;
+  }
+
+  // Requests that can not be sent stay queued until all slots are taken.
+  send_result = -1;
+  for (size_t i = 0; i < REQUEST_MAX_IN_FLIGHT; i++) {
+    submit_command(&tracker, COMMAND_GET_STATUS, 0, 40000000);
+  }
+  if (submit_command(&tracker, COMMAND_GET_STATUS, 0, 40000000) != -1 || tracker.rejected != 1) {
+    printf("Failed to reject a request with all slots taken.\n");
+    return -1;
+  }
+
+  send_result = 0;
+  sent = number_sent_frames;
+  request_tracker_poll(&tracker, 40500000);
+  if (number_sent_frames != sent + tracker.window) {
+    printf("Failed to send queued requests.\n");
+    return -1;
+  }
+
+  // Requests that could not be sent within the timeout are dropped.
+  send_result = -1;
+  request_tracker_poll(&tracker, 41000000);
+  if (request_tracker_count(&tracker, REQUEST_PENDING) != 0 ||
+      request_tracker_count(&tracker, REQUEST_IN_FLIGHT) != tracker.window) {
+    printf("Failed to expire stale queued requests.\n");
+    return -1;
+  }
+  send_result = 0;
+
+  // Templates get their sequence number patched in.
+  frame_template_t template;
+  message_t msg;
+  message_init(&msg);
+  message_tlv_add_command(&msg, COMMAND_GET_STATUS);
+  message_tlv_add_power_reading(&msg, 0);
+  message_tlv_add_sequence(&msg, 0);
+  frame_template_init(&template, &msg, TLV_POWER_READING);
+  message_free(&msg);
+
+  request_tracker_flush(&tracker);
+  if (request_tracker_submit_template(&tracker, &template, COMMAND_GET_STATUS, 0, 50000000) != 0 ||
+      message_tlv_get_sequence(&last_sent_message, &sequence) != MESSAGE_SUCCESS ||
+      sequence != tracker.next_sequence - 1) {
+    printf("Failed to send a request from a template.\n");
+    return -1;
+  }
+
+  message_free(&last_sent_message);
+  return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "sfp_ddm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int write_fake_device(const char *path, uint8_t monitoring_type, size_t length)
+{
+  uint8_t pages[2 * SFP_DDM_PAGE_SIZE];
+  memset(pages, 0, sizeof(pages));
+  pages[92] = monitoring_type;
+
+  // 35.5 C, 3.3 V, 6 mA, 0.5 mW transmitted and 0.1234 mW received.
+  const uint8_t values[] = {0x23, 0x80, 0x80, 0xE8, 0x0B, 0xB8, 0x13, 0x88, 0x04, 0xD2};
+  memcpy(&pages[SFP_DDM_PAGE_SIZE + 96], values, sizeof(values));
+
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    return -1;
+  }
+  fwrite(pages, 1, length, file);
+  fclose(file);
+  return 0;
+}
+
+int main()
+{
+  char path[] = "/tmp/test_sfp_ddm_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    printf("Failed to create temporary file.\n");
+    return -1;
+  }
+  close(fd);
+
+  // Internally calibrated module.
+  sfp_ddm_reader_t reader;
+  sfp_ddm_t ddm;
+  write_fake_device(path, 0x68, 2 * SFP_DDM_PAGE_SIZE);
+  if (sfp_ddm_open(&reader, path) != 0) {
+    printf("Failed to open fake SFP device.\n");
+    return -1;
+  }
+
+  if (sfp_ddm_read(&reader, &ddm) != 0) {
+    printf("Failed to read diagnostics.\n");
+    return -1;
+  }
+
+  if (ddm.rx_power != 1234 || ddm.tx_power != 5000 || sfp_ddm_temperature_mc(&ddm) != 35500 ||
+      sfp_ddm_vcc_mv(&ddm) != 3300 || sfp_ddm_tx_bias_ua(&ddm) != 6000) {
+    printf("Diagnostic values are invalid.\n");
+    return -1;
+  }
+  sfp_ddm_close(&reader);
+
+  // Negative temperatures are sign-extended.
+  const uint8_t negative[] = {0xF6, 0x00, 0, 0, 0, 0, 0, 0, 0, 0};
+  sfp_ddm_decode(negative, &ddm);
+  if (sfp_ddm_temperature_mc(&ddm) != -10000) {
+    printf("Negative temperature is invalid.\n");
+    return -1;
+  }
+
+  // Modules are checked on every read, so swapping in an externally
+  // calibrated module or one without diagnostics is detected.
+  if (sfp_ddm_open(&reader, path) != 0) {
+    printf("Failed to reopen fake SFP device.\n");
+    return -1;
+  }
+
+  write_fake_device(path, 0x58, 2 * SFP_DDM_PAGE_SIZE);
+  if (sfp_ddm_read(&reader, &ddm) == 0) {
+    printf("Externally calibrated module was not rejected.\n");
+    return -1;
+  }
+
+  write_fake_device(path, 0x20, 2 * SFP_DDM_PAGE_SIZE);
+  if (sfp_ddm_read(&reader, &ddm) == 0) {
+    printf("Module without diagnostics was not rejected.\n");
+    return -1;
+  }
+
+  write_fake_device(path, 0x68, 2 * SFP_DDM_PAGE_SIZE);
+  if (sfp_ddm_read(&reader, &ddm) != 0 || ddm.rx_power != 1234) {
+    printf("Failed to read diagnostics after the module was swapped back.\n");
+    return -1;
+  }
+
+  // Short reads are reported.
+  write_fake_device(path, 0x68, SFP_DDM_PAGE_SIZE + 100);
+  if (sfp_ddm_read(&reader, &ddm) == 0) {
+    printf("Truncated diagnostics were not detected.\n");
+    return -1;
+  }
+  sfp_ddm_close(&reader);
+
+  unlink(path);
+  return 0;
+}
@@ -19,6 +19,7 @@
 #include "message.h"
 
 #include <stdio.h>
+#include <string.h>
 
 int main()
 {
@@ -81,7 +82,144 @@ int main()
     return -1;
   }
 
+  // Decode all TLVs at once.
+  message_report_t report;
+  if (message_decode(&msg_parsed, &report) != MESSAGE_SUCCESS ||
+      !MESSAGE_REPORT_HAS(&report, COMMAND) ||
+      !MESSAGE_REPORT_HAS(&report, MOTOR_POSITION) ||
+      MESSAGE_REPORT_HAS(&report, ENCODER_VALUE) ||
+      report.command != COMMAND_RESTORE_MOTOR ||
+      report.motor_position.x != position.x ||
+      report.motor_position.y != position.y ||
+      report.motor_position.z != position.z) {
+    printf("Failed to decode message report.\n");
+    message_free(&msg);
+    return -1;
+  }
+
+  // TLVs with an unexpected length must be rejected.
+  message_t msg_invalid;
+  message_init(&msg_invalid);
+  message_tlv_add(&msg_invalid, TLV_MOTOR_POSITION, 8, buffer);
+  if (message_validate(&msg_invalid) != MESSAGE_ERROR_INVALID_LENGTH ||
+      message_decode(&msg_invalid, &report) != MESSAGE_ERROR_INVALID_LENGTH ||
+      message_tlv_get_motor_position(&msg_invalid, &parsed_position) != MESSAGE_ERROR_INVALID_LENGTH ||
+      message_validate(&msg) != MESSAGE_SUCCESS) {
+    printf("Invalid TLV length was not detected.\n");
+    message_free(&msg_invalid);
+    message_free(&msg);
+    return -1;
+  }
+  message_free(&msg_invalid);
+
+  // Verify the checksum without parsing, then corrupt the motor position.
+  if (message_verify(buffer, length) != MESSAGE_SUCCESS) {
+    printf("Failed to verify serialized message.\n");
+    message_free(&msg);
+    return -1;
+  }
+
+  message_free(&msg_parsed);
+  buffer[7] ^= 0x01;
+  if (message_verify(buffer, length) != MESSAGE_ERROR_CHECKSUM_MISMATCH ||
+      message_parse(&msg_parsed, buffer, length) != MESSAGE_ERROR_CHECKSUM_MISMATCH) {
+    printf("Corrupted message was not rejected.\n");
+    message_free(&msg);
+    return -1;
+  }
+  buffer[7] ^= 0x01;
+
+  // Parse the same buffer without copying TLV values.
+  message_t msg_view;
+  result = message_parse_view(&msg_view, buffer, length);
+  if (result != MESSAGE_SUCCESS) {
+    printf("Failed to parse serialized message in view mode: %d\n", result);
+    message_free(&msg);
+    return -1;
+  }
+
+  if (msg_view.length != msg.length || msg_view.tlv[0].value != &buffer[3]) {
+    printf("View mode message does not reference the source buffer.\n");
+    message_free(&msg);
+    return -1;
+  }
+
+  if (message_tlv_add_command(&msg_view, COMMAND_GET_STATUS) != MESSAGE_ERROR_READ_ONLY) {
+    printf("Adding a TLV to a view mode message should fail.\n");
+    message_free(&msg);
+    return -1;
+  }
+
+  // Copies must remain valid after the source buffer changes.
+  message_t msg_copy;
+  if (message_copy(&msg_copy, &msg_view) != MESSAGE_SUCCESS) {
+    printf("Failed to copy view mode message.\n");
+    message_free(&msg);
+    return -1;
+  }
+
+  memset(buffer, 0, sizeof(buffer));
+  message_free(&msg_view);
+
+  if (message_tlv_get_motor_position(&msg_copy, &parsed_position) != MESSAGE_SUCCESS ||
+      parsed_position.x != position.x ||
+      parsed_position.y != position.y ||
+      parsed_position.z != position.z) {
+    printf("Copied message values are invalid.\n");
+    message_free(&msg_copy);
+    message_free(&msg);
+    return -1;
+  }
+
+  message_free(&msg_copy);
   message_free(&msg);
 
+  // Build the same message in an arena and check that it serializes identically.
+  uint8_t arena[32];
+  message_t msg_arena;
+  message_init_arena(&msg_arena, arena, sizeof(arena));
+  message_tlv_add_command(&msg_arena, COMMAND_RESTORE_MOTOR);
+  message_tlv_add_motor_position(&msg_arena, &position);
+  message_tlv_add_checksum(&msg_arena);
+
+  uint8_t buffer_arena[1024];
+  length = message_serialize(buffer, sizeof(buffer), &msg_arena);
+  message_init(&msg);
+  message_tlv_add_command(&msg, COMMAND_RESTORE_MOTOR);
+  message_tlv_add_motor_position(&msg, &position);
+  message_tlv_add_checksum(&msg);
+  if (message_serialize(buffer_arena, sizeof(buffer_arena), &msg) != length ||
+      memcmp(buffer, buffer_arena, length) != 0) {
+    printf("Arena message serialization differs.\n");
+    message_free(&msg);
+    return -1;
+  }
+  message_free(&msg);
+
+  tlv_vibration_value_t vibration = {{0}};
+  if (message_tlv_add_vibration_value(&msg_arena, &vibration) != MESSAGE_ERROR_BUFFER_TOO_SMALL) {
+    printf("Adding a TLV to a full arena should fail.\n");
+    return -1;
+  }
+
+  // Duplicated TLVs are detected and the first one is returned.
+  tlv_command_t duplicated_command;
+  if (message_tlv_duplicated(&msg_arena, TLV_COMMAND) ||
+      message_tlv_add_command(&msg_arena, COMMAND_HOMING) != MESSAGE_SUCCESS ||
+      !message_tlv_duplicated(&msg_arena, TLV_COMMAND) ||
+      message_tlv_duplicated(&msg_arena, TLV_MOTOR_POSITION) ||
+      message_tlv_get_command(&msg_arena, &duplicated_command) != MESSAGE_SUCCESS ||
+      duplicated_command != COMMAND_RESTORE_MOTOR) {
+    printf("Duplicated TLV detection failed.\n");
+    return -1;
+  }
+
+  message_free(&msg_arena);
+  if (message_tlv_find(&msg_arena, TLV_COMMAND) != NULL || msg_arena.length != 0 || message_tlv_add_command(&msg_arena, COMMAND_GET_STATUS) != MESSAGE_SUCCESS ||
+      msg_arena.tlv[0].value != arena) {
+    printf("Arena message was not reset.\n");
+    return -1;
+  }
+
   return 0;
 }
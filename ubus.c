@@ -20,6 +20,7 @@
 #include "koruza.h"
 #include "network.h"
 #include "upgrade.h"
+#include "serial.h"
 
 #include <libubox/blobmsg.h>
 
@@ -68,6 +69,14 @@ static inline void blobmsg_add_float(struct blob_buf *buffer, const char *name,
   blobmsg_add_string(buffer, name, tmp);
 }
 
+static void blobmsg_add_report_age(struct blob_buf *buffer, uint64_t timestamp)
+{
+  // Time since the report was received (in milliseconds).
+  if (timestamp) {
+    blobmsg_add_u32(buffer, "report_age", (frame_timestamp_now() - timestamp) / 1000000);
+  }
+}
+
 static void blobmsg_add_accelerometer_statistics_item(struct blob_buf *buffer,
                                                       const struct accelerometer_statistics_item *items,
                                                       const char *name)
@@ -108,6 +117,7 @@ static int ubus_get_status(struct ubus_context *ctx, struct ubus_object *obj,
 
   c = blobmsg_open_table(&reply_buf, "motors");
   blobmsg_add_u8(&reply_buf, "connected", status->motors.connected);
+  blobmsg_add_u8(&reply_buf, "streaming", status->motors.streaming);
   blobmsg_add_u32(&reply_buf, "x", status->motors.x);
   blobmsg_add_u32(&reply_buf, "y", status->motors.y);
   blobmsg_add_u32(&reply_buf, "z", status->motors.z);
@@ -115,11 +125,14 @@ static int ubus_get_status(struct ubus_context *ctx, struct ubus_object *obj,
   blobmsg_add_u32(&reply_buf, "range_y", status->motors.range_y);
   blobmsg_add_u32(&reply_buf, "encoder_x", status->motors.encoder_x);
   blobmsg_add_u32(&reply_buf, "encoder_y", status->motors.encoder_y);
+  blobmsg_add_report_age(&reply_buf, status->motors.timestamp);
   blobmsg_close_table(&reply_buf, c);
 
   koruza_compute_accelerometer_statistics();
   c = blobmsg_open_table(&reply_buf, "accelerometer");
   blobmsg_add_u8(&reply_buf, "connected", status->accelerometer.connected);
+  blobmsg_add_u8(&reply_buf, "streaming", status->accelerometer.streaming);
+  blobmsg_add_report_age(&reply_buf, status->accelerometer.timestamp);
 
   blobmsg_add_accelerometer_statistics_item(&reply_buf, status->accelerometer.x, "x");
   blobmsg_add_accelerometer_statistics_item(&reply_buf, status->accelerometer.y, "y");
@@ -167,6 +180,151 @@ static int ubus_get_status(struct ubus_context *ctx, struct ubus_object *obj,
   return UBUS_STATUS_OK;
 }
 
+static void blobmsg_add_serial_statistics(struct blob_buf *buffer, serial_device_t device)
+{
+  const char *name = serial_get_device_name(device);
+  struct serial_statistics statistics;
+  if (serial_get_statistics(device, &statistics) != 0) {
+    return;
+  }
+
+  void *c = blobmsg_open_table(buffer, name);
+  blobmsg_add_u8(buffer, "connected", statistics.connected);
+  blobmsg_add_u64(buffer, "connects", statistics.connects);
+  blobmsg_add_u64(buffer, "disconnects", statistics.disconnects);
+  // Attach latency is reported in microseconds.
+  blobmsg_add_u64(buffer, "attach_latency", statistics.attach_latency / 1000);
+  blobmsg_add_u64(buffer, "bytes_in", statistics.parser.bytes);
+  blobmsg_add_u64(buffer, "bytes_out", statistics.bytes_out);
+  blobmsg_add_u64(buffer, "frames_in", statistics.parser.frames);
+  blobmsg_add_u64(buffer, "frames_out", statistics.frames_out);
+  blobmsg_add_u64(buffer, "queue_length", statistics.queue_length);
+  blobmsg_add_float(buffer, "tlvs_per_frame",
+    statistics.parser.frames ? (float) statistics.parser.tlvs / statistics.parser.frames : 0);
+
+  void *d = blobmsg_open_table(buffer, "errors");
+  blobmsg_add_u64(buffer, "resync", statistics.parser.resyncs);
+  blobmsg_add_u64(buffer, "oversized", statistics.parser.oversized);
+  blobmsg_add_u64(buffer, "parse", statistics.parser.parse_errors);
+  blobmsg_add_u64(buffer, "checksum", statistics.parser.checksum_errors);
+  blobmsg_add_u64(buffer, "read", statistics.read_errors);
+  blobmsg_add_u64(buffer, "write", statistics.write_errors);
+  blobmsg_add_u64(buffer, "queue_full", statistics.queue_full);
+  blobmsg_close_table(buffer, d);
+
+  // Handler times are reported in microseconds.
+  d = blobmsg_open_table(buffer, "handler_time");
+  blobmsg_add_u64(buffer, "total", statistics.parser.handler_time / 1000);
+  blobmsg_add_u64(buffer, "max", statistics.parser.handler_time_max / 1000);
+  blobmsg_add_float(buffer, "average",
+    statistics.parser.frames ? (float) statistics.parser.handler_time / statistics.parser.frames / 1000 : 0);
+  blobmsg_close_table(buffer, d);
+
+  blobmsg_close_table(buffer, c);
+}
+
+static int ubus_get_statistics(struct ubus_context *ctx, struct ubus_object *obj,
+                               struct ubus_request_data *req, const char *method,
+                               struct blob_attr *msg)
+{
+  blob_buf_init(&reply_buf, 0);
+
+  void *c = blobmsg_open_table(&reply_buf, "serial");
+  for (serial_device_t device = 0; device < serial_get_device_count(); device++) {
+    blobmsg_add_serial_statistics(&reply_buf, device);
+  }
+  blobmsg_close_table(&reply_buf, c);
+
+  // SFP polling cycle times are reported in microseconds.
+  const struct koruza_sfp_statistics *sfp = koruza_get_sfp_statistics();
+  c = blobmsg_open_table(&reply_buf, "sfp");
+  blobmsg_add_u64(&reply_buf, "cycles", sfp->cycles);
+  blobmsg_add_u64(&reply_buf, "skipped", sfp->skipped);
+  blobmsg_add_u64(&reply_buf, "failed", sfp->failed);
+  blobmsg_add_u64(&reply_buf, "aborted", sfp->aborted);
+  blobmsg_add_u64(&reply_buf, "invalidations", sfp->invalidations);
+  blobmsg_add_u64(&reply_buf, "last_cycle_time", sfp->last_cycle_time / 1000);
+  blobmsg_add_u64(&reply_buf, "direct_reads", sfp->direct_reads);
+  blobmsg_add_u64(&reply_buf, "direct_errors", sfp->direct_errors);
+  blobmsg_add_u64(&reply_buf, "last_direct_read_time", sfp->last_direct_read_time / 1000);
+  blobmsg_close_table(&reply_buf, c);
+
+  ubus_send_reply(ctx, req, reply_buf.head);
+
+  return UBUS_STATUS_OK;
+}
+
+static void blobmsg_add_request_histogram(struct blob_buf *buffer, const request_tracker_t *tracker,
+                                          tlv_command_t command, const char *name)
+{
+  const request_histogram_t *histogram = request_tracker_histogram(tracker, command);
+  if (!histogram) {
+    return;
+  }
+
+  // Round-trip times are reported in microseconds.
+  void *c = blobmsg_open_table(buffer, name);
+  blobmsg_add_u64(buffer, "count", histogram->count);
+  blobmsg_add_u64(buffer, "min", histogram->min);
+  blobmsg_add_u64(buffer, "max", histogram->max);
+  blobmsg_add_float(buffer, "average", histogram->count ? (float) histogram->sum / histogram->count : 0);
+
+  // Buckets are listed by their upper bound, up to the last non-empty one.
+  size_t last = 0;
+  for (size_t i = 0; i < REQUEST_HISTOGRAM_BUCKETS; i++) {
+    if (histogram->buckets[i]) {
+      last = i + 1;
+    }
+  }
+
+  void *d = blobmsg_open_array(buffer, "buckets");
+  for (size_t i = 0; i < last; i++) {
+    void *e = blobmsg_open_table(buffer, NULL);
+    blobmsg_add_u64(buffer, "upper", 1ULL << i);
+    blobmsg_add_u64(buffer, "count", histogram->buckets[i]);
+    blobmsg_close_table(buffer, e);
+  }
+  blobmsg_close_array(buffer, d);
+
+  blobmsg_close_table(buffer, c);
+}
+
+static void blobmsg_add_request_tracker(struct blob_buf *buffer, serial_device_t device)
+{
+  const char *name = serial_get_device_name(device);
+  const request_tracker_t *tracker = koruza_get_request_tracker(device);
+  if (!tracker) {
+    return;
+  }
+
+  void *c = blobmsg_open_table(buffer, name);
+  blobmsg_add_u8(buffer, "sequence_supported", tracker->sequence_supported);
+  blobmsg_add_u32(buffer, "window", tracker->window);
+  blobmsg_add_u32(buffer, "in_flight", request_tracker_count(tracker, REQUEST_IN_FLIGHT));
+  blobmsg_add_u32(buffer, "pending", request_tracker_count(tracker, REQUEST_PENDING));
+  blobmsg_add_u64(buffer, "unmatched", tracker->unmatched);
+  blobmsg_add_u64(buffer, "expired", tracker->expired);
+  blobmsg_add_u64(buffer, "retried", tracker->retried);
+  blobmsg_add_u64(buffer, "rejected", tracker->rejected);
+  blobmsg_add_request_histogram(buffer, tracker, COMMAND_GET_STATUS, "get_status");
+  blobmsg_add_request_histogram(buffer, tracker, COMMAND_MOVE_MOTOR, "move_motor");
+  blobmsg_add_request_histogram(buffer, tracker, COMMAND_HOMING, "homing");
+  blobmsg_close_table(buffer, c);
+}
+
+static int ubus_get_latency(struct ubus_context *ctx, struct ubus_object *obj,
+                            struct ubus_request_data *req, const char *method,
+                            struct blob_attr *msg)
+{
+  blob_buf_init(&reply_buf, 0);
+  for (serial_device_t device = 0; device < serial_get_device_count(); device++) {
+    blobmsg_add_request_tracker(&reply_buf, device);
+  }
+  ubus_send_reply(ctx, req, reply_buf.head);
+
+  return UBUS_STATUS_OK;
+}
+
 static int ubus_homing(struct ubus_context *ctx, struct ubus_object *obj,
                        struct ubus_request_data *req, const char *method,
                        struct blob_attr *msg)
@@ -378,6 +536,8 @@ static const struct ubus_method koruza_methods[] = {
   UBUS_METHOD_NOARG("reboot", ubus_reboot),
   UBUS_METHOD_NOARG("firmware_upgrade", ubus_firmware_upgrade),
   UBUS_METHOD_NOARG("get_status", ubus_get_status),
+  UBUS_METHOD_NOARG("get_statistics", ubus_get_statistics),
+  UBUS_METHOD_NOARG("get_latency", ubus_get_latency),
   UBUS_METHOD("set_webcam_calibration", ubus_set_webcam_calibration, koruza_calibration_policy),
   UBUS_METHOD("set_distance", ubus_set_distance, koruza_distance_policy),
   UBUS_METHOD_NOARG("get_survey", ubus_get_survey),